@@ -0,0 +1,206 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+
+/*
+Two allocators: plain malloc, and a pool with power-of-2 size classes
+whose blocks are bump-allocated from 64k slabs and recycled through a
+free list per class. Nothing in a slab is zeroed; String_alloc writes
+what it needs. Anything bigger than the largest class is malloc'd with a
+link header so release can still find it. A VM owns one pool, so there's
+no locking, and vm_free drops all its Strings at once by releasing slabs.
+ */
+
+typedef struct slab {
+    struct slab *next;
+    size_t pad;         // keep blocks 16-byte aligned
+} Slab;
+
+typedef struct large_block {
+    struct large_block *prev;
+    struct large_block *next;
+    size_t size;
+    size_t pad;
+} Large_Block;
+
+typedef struct {
+    Allocator base;
+    void *free_lists[POOL_NUM_CLASSES]; // first word of a free block links to the next
+    char *bump;
+    char *bump_end;
+    Slab *slabs;
+    Large_Block *large;
+} Pool_Allocator;
+
+static __thread Allocator *current = NULL;
+
+static void *malloc_alloc(Allocator *a, size_t size) {
+    a->stats.allocs++;
+    a->stats.live_bytes += size;
+    a->stats.total_bytes += size;
+    return malloc(size);
+}
+
+static void malloc_free(Allocator *a, void *p, size_t size) {
+    a->stats.frees++;
+    a->stats.live_bytes -= size;
+    free(p);
+}
+
+static void malloc_release(Allocator *a) { (void)a; } // the shared malloc allocator lives forever
+
+static void malloc_reset(Allocator *a) { (void)a; } // can't find its blocks; owners free them one by one
+
+Allocator *malloc_allocator() {
+    static __thread Allocator a = {
+        .alloc = malloc_alloc, .free = malloc_free, .release = malloc_release, .reset = malloc_reset
+    };
+    return &a;
+}
+
+static inline int size_class(size_t size) {
+    int c = 0;
+    size_t block = (size_t)POOL_MIN_CLASS;
+    while (block < size) {
+        block <<= 1;
+        c++;
+    }
+    return c;
+}
+
+static void *pool_alloc(Allocator *a, size_t size) {
+    Pool_Allocator *pool = (Pool_Allocator *)a;
+    int c = size_class(size);
+    a->stats.allocs++;
+    a->stats.live_bytes += size;
+    a->stats.total_bytes += size;
+    if (c >= POOL_NUM_CLASSES) {
+        Large_Block *b = malloc(sizeof(Large_Block) + size);
+        if (b == NULL) return NULL;
+        b->prev = NULL;
+        b->next = pool->large;
+        b->size = size;
+        if (pool->large != NULL) pool->large->prev = b;
+        pool->large = b;
+        a->stats.large++;
+        a->stats.reserved_bytes += sizeof(Large_Block) + size;
+        return b + 1;
+    }
+    void *p = pool->free_lists[c];
+    if (p != NULL) {
+        pool->free_lists[c] = *(void **)p;
+        return p;
+    }
+    size_t block = (size_t)POOL_MIN_CLASS << c;
+    if (pool->bump + block > pool->bump_end) {
+        Slab *s = malloc((size_t)POOL_SLAB_SIZE);
+        if (s == NULL) return NULL;
+        s->next = pool->slabs;
+        pool->slabs = s;
+        pool->bump = (char *)(s + 1);
+        pool->bump_end = (char *)s + POOL_SLAB_SIZE;
+        a->stats.slabs++;
+        a->stats.reserved_bytes += POOL_SLAB_SIZE;
+    }
+    p = pool->bump;
+    pool->bump += block;
+    return p;
+}
+
+static void pool_free(Allocator *a, void *p, size_t size) {
+    Pool_Allocator *pool = (Pool_Allocator *)a;
+    int c = size_class(size);
+    a->stats.frees++;
+    a->stats.live_bytes -= size;
+    if (c >= POOL_NUM_CLASSES) {
+        Large_Block *b = (Large_Block *)p - 1;
+        if (b->prev != NULL) b->prev->next = b->next;
+        else pool->large = b->next;
+        if (b->next != NULL) b->next->prev = b->prev;
+        a->stats.reserved_bytes -= sizeof(Large_Block) + b->size;
+        free(b);
+        return;
+    }
+    *(void **)p = pool->free_lists[c];
+    pool->free_lists[c] = p;
+}
+
+static void pool_release(Allocator *a) {
+    Pool_Allocator *pool = (Pool_Allocator *)a;
+    if (current == a) current = NULL;
+    while (pool->slabs != NULL) {
+        Slab *next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    while (pool->large != NULL) {
+        Large_Block *next = pool->large->next;
+        free(pool->large);
+        pool->large = next;
+    }
+    free(pool);
+}
+
+/* Keep the newest slab to bump from again and give the rest back */
+static void pool_reset(Allocator *a) {
+    Pool_Allocator *pool = (Pool_Allocator *)a;
+    while (pool->large != NULL) {
+        Large_Block *next = pool->large->next;
+        a->stats.reserved_bytes -= sizeof(Large_Block) + pool->large->size;
+        free(pool->large);
+        pool->large = next;
+    }
+    if (pool->slabs != NULL) {
+        while (pool->slabs->next != NULL) {
+            Slab *next = pool->slabs->next->next;
+            free(pool->slabs->next);
+            pool->slabs->next = next;
+            a->stats.reserved_bytes -= POOL_SLAB_SIZE;
+        }
+        pool->bump = (char *)(pool->slabs + 1);
+    }
+    memset(pool->free_lists, 0, sizeof(pool->free_lists));
+    a->stats.live_bytes = 0;
+}
+
+Allocator *pool_allocator_new() {
+    Pool_Allocator *pool = calloc(1, sizeof(Pool_Allocator));
+    pool->base.alloc = pool_alloc;
+    pool->base.free = pool_free;
+    pool->base.release = pool_release;
+    pool->base.reset = pool_reset;
+    return &pool->base;
+}
+
+/* The allocator Strings on this thread come from; malloc if no VM set one */
+Allocator *allocator_current() {
+    return current != NULL ? current : malloc_allocator();
+}
+
+void allocator_use(Allocator *a) {
+    current = a;
+}
@@ -0,0 +1,59 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stddef.h>
+
+#ifndef ALLOCATOR_H_
+#define ALLOCATOR_H_
+
+static const int POOL_MIN_CLASS = 16;			// bytes in the smallest size class
+static const int POOL_NUM_CLASSES = 8;			// 16, 32, ..., 2048 bytes
+static const int POOL_SLAB_SIZE = 64 * 1024;	// size classes are carved out of slabs this big
+
+typedef struct {
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long slabs;		// slabs carved into size-class blocks
+	unsigned long large;		// allocs too big for a size class
+	size_t live_bytes;			// requested bytes not yet freed
+	size_t total_bytes;			// requested bytes ever
+	size_t reserved_bytes;		// slab + large bytes held from malloc
+} Alloc_Stats;
+
+/* Where Strings come from. The VM running on a thread makes its allocator
+ * current; free must be passed the same size alloc was given.
+ */
+typedef struct allocator {
+	void *(*alloc)(struct allocator *a, size_t size);
+	void (*free)(struct allocator *a, void *p, size_t size);
+	void (*release)(struct allocator *a);	// free everything handed out and the allocator itself
+	void (*reset)(struct allocator *a);		// free everything handed out but keep the allocator warm
+	Alloc_Stats stats;
+} Allocator;
+
+extern Allocator *malloc_allocator();
+extern Allocator *pool_allocator_new();
+extern Allocator *allocator_current();
+extern void allocator_use(Allocator *a);
+
+#endif
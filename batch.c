@@ -0,0 +1,615 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "vm.h"
+#include "loader.h"
+#include "batch.h"
+#include "natives.h"
+
+/*
+Lockstep execution of one program over many inputs.
+
+Every stack slot and local is a row of nlanes values so an int/boolean
+instruction is one pass over a row with a lane mask; those passes are
+SSE2 kernels with a scalar fallback. Strings stay per-lane scalar.
+
+When lanes disagree (a BRF, or a RET to different return addresses) the
+group splits. The waiting group in the deepest frame with the lowest ip
+runs next, so lanes that took a short path wait at the join point and
+merge back in as soon as the running group reaches the same ip, sp and
+callsp.
+ */
+
+typedef enum {
+    LANE_ADD, LANE_SUB, LANE_MUL,
+    LANE_AND, LANE_OR,
+    LANE_EQ, LANE_NEQ, LANE_LT, LANE_LE, LANE_GT, LANE_GE
+} Lane_Op;
+
+#define ROW(b, slot)            ((long)(slot) * (b)->nlanes)
+#define FRAME_ROW(b, d, slot)   ((long)((d) * MAX_LOCALS + (slot)) * (b)->nlanes)
+
+#ifdef __SSE2__
+/* SSE2 has no 32-bit mullo; multiply even and odd lanes separately */
+static inline __m128i lanes_mullo(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+#define LANE_LOOP(expr) \
+    for (; i + 4 <= n; i += 4) { \
+        __m128i va = _mm_loadu_si128((const __m128i *)&a[i]); \
+        __m128i vb = _mm_loadu_si128((const __m128i *)&b[i]); \
+        __m128i vm = _mm_loadu_si128((const __m128i *)&mask[i]); \
+        __m128i r = (expr); \
+        _mm_storeu_si128((__m128i *)&a[i], _mm_or_si128(_mm_and_si128(vm, r), _mm_andnot_si128(vm, va))); \
+    }
+#endif
+
+/* a[l] = a[l] op b[l] for lanes in mask; comparisons leave 0/1 */
+static void lanes_binop(Lane_Op op, int32_t *a, const int32_t *b, const int32_t *mask, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i one = _mm_set1_epi32(1);
+    switch (op) {
+        case LANE_ADD: LANE_LOOP(_mm_add_epi32(va, vb)); break;
+        case LANE_SUB: LANE_LOOP(_mm_sub_epi32(va, vb)); break;
+        case LANE_MUL: LANE_LOOP(lanes_mullo(va, vb)); break;
+        case LANE_AND: LANE_LOOP(_mm_and_si128(va, vb)); break;
+        case LANE_OR:  LANE_LOOP(_mm_or_si128(va, vb)); break;
+        case LANE_EQ:  LANE_LOOP(_mm_and_si128(_mm_cmpeq_epi32(va, vb), one)); break;
+        case LANE_NEQ: LANE_LOOP(_mm_andnot_si128(_mm_cmpeq_epi32(va, vb), one)); break;
+        case LANE_LT:  LANE_LOOP(_mm_and_si128(_mm_cmplt_epi32(va, vb), one)); break;
+        case LANE_LE:  LANE_LOOP(_mm_andnot_si128(_mm_cmpgt_epi32(va, vb), one)); break;
+        case LANE_GT:  LANE_LOOP(_mm_and_si128(_mm_cmpgt_epi32(va, vb), one)); break;
+        case LANE_GE:  LANE_LOOP(_mm_andnot_si128(_mm_cmplt_epi32(va, vb), one)); break;
+    }
+#endif
+    for (; i < n; i++) {
+        if (!mask[i]) continue;
+        switch (op) {
+            case LANE_ADD: a[i] = a[i] + b[i]; break;
+            case LANE_SUB: a[i] = a[i] - b[i]; break;
+            case LANE_MUL: a[i] = a[i] * b[i]; break;
+            case LANE_AND: a[i] = a[i] & b[i]; break;
+            case LANE_OR:  a[i] = a[i] | b[i]; break;
+            case LANE_EQ:  a[i] = a[i] == b[i]; break;
+            case LANE_NEQ: a[i] = a[i] != b[i]; break;
+            case LANE_LT:  a[i] = a[i] < b[i]; break;
+            case LANE_LE:  a[i] = a[i] <= b[i]; break;
+            case LANE_GT:  a[i] = a[i] > b[i]; break;
+            case LANE_GE:  a[i] = a[i] >= b[i]; break;
+        }
+    }
+}
+
+/* a[l] = -a[l] (negate) or !a[l] for lanes in mask */
+static void lanes_unop(bool negate, int32_t *a, const int32_t *mask, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i one = _mm_set1_epi32(1);
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)&a[i]);
+        __m128i vm = _mm_loadu_si128((const __m128i *)&mask[i]);
+        __m128i r = negate ? _mm_sub_epi32(_mm_setzero_si128(), va)
+                           : _mm_and_si128(_mm_cmpeq_epi32(va, _mm_setzero_si128()), one);
+        _mm_storeu_si128((__m128i *)&a[i], _mm_or_si128(_mm_and_si128(vm, r), _mm_andnot_si128(vm, va)));
+    }
+#endif
+    for (; i < n; i++) {
+        if (mask[i]) a[i] = negate ? -a[i] : !a[i];
+    }
+}
+
+/* a[l] = v for lanes in mask */
+static void lanes_fill(int32_t *a, int32_t v, const int32_t *mask, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    __m128i vv = _mm_set1_epi32(v);
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)&a[i]);
+        __m128i vm = _mm_loadu_si128((const __m128i *)&mask[i]);
+        _mm_storeu_si128((__m128i *)&a[i], _mm_or_si128(_mm_and_si128(vm, vv), _mm_andnot_si128(vm, va)));
+    }
+#endif
+    for (; i < n; i++) {
+        if (mask[i]) a[i] = v;
+    }
+}
+
+static void lanes_set_type(byte *type, element_type t, const int32_t *mask, int n) {
+    for (int i = 0; i < n; i++) {
+        if (mask[i]) type[i] = (byte)t;
+    }
+}
+
+/* Copy one slot row to another for lanes in mask; a full group is a memcpy */
+static void lanes_move(VM_Batch *b, int32_t *dst_i, byte *dst_t, String **dst_s,
+                       const int32_t *src_i, const byte *src_t, String *const *src_s) {
+    int n = b->nlanes;
+    if (b->active == b->ninstances) {
+        memcpy(dst_i, src_i, n * sizeof(int32_t));
+        memcpy(dst_t, src_t, n * sizeof(byte));
+        memcpy(dst_s, src_s, n * sizeof(String *));
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!b->mask[i]) continue;
+        dst_i[i] = src_i[i];
+        dst_t[i] = src_t[i];
+        dst_s[i] = src_s[i];
+    }
+}
+
+static void lane_print(VM_Batch *b, int l, const char *s) {
+    size_t n = strlen(s);
+    if (b->output_len[l] + n + 1 > b->output_cap[l]) {
+        while (b->output_len[l] + n + 1 > b->output_cap[l]) b->output_cap[l] = b->output_cap[l] * 2 + 64;
+        b->output[l] = realloc(b->output[l], b->output_cap[l]);
+    }
+    memcpy(&b->output[l][b->output_len[l]], s, n + 1);
+    b->output_len[l] += n;
+}
+
+static int find_group(VM_Batch *b, addr32 ip, int sp, int callsp) {
+    for (int g = 0; g < b->num_waiting; g++) {
+        Lane_Group *w = &b->waiting[g];
+        if (w->ip == ip && w->sp == sp && w->callsp == callsp) return g;
+    }
+    return -1;
+}
+
+static void add_group(VM_Batch *b, addr32 ip, int sp, int callsp) {
+    if (find_group(b, ip, sp, callsp) >= 0) return;
+    b->waiting[b->num_waiting].ip = ip;
+    b->waiting[b->num_waiting].sp = sp;
+    b->waiting[b->num_waiting].callsp = callsp;
+    b->num_waiting++;
+}
+
+/* deeper frames first, then lower ip */
+static bool runs_before(Lane_Group *a, addr32 ip, int callsp) {
+    return a->callsp > callsp || (a->callsp == callsp && a->ip < ip);
+}
+
+/* Park the running group's lanes, each at its own lane_ip */
+static void suspend(VM_Batch *b, bool same_ip) {
+    for (int l = 0; l < b->nlanes; l++) {
+        if (!b->mask[l]) continue;
+        if (same_ip) b->lane_ip[l] = b->ip;
+        b->lane_sp[l] = b->sp;
+        b->lane_callsp[l] = b->callsp;
+        add_group(b, b->lane_ip[l], b->sp, b->callsp);
+        b->mask[l] = 0;
+    }
+    b->active = 0;
+}
+
+/* Make the best waiting group the running one; false when all lanes are done */
+static bool resume(VM_Batch *b) {
+    while (b->num_waiting > 0) {
+        int best = 0;
+        for (int g = 1; g < b->num_waiting; g++) {
+            if (runs_before(&b->waiting[g], b->waiting[best].ip, b->waiting[best].callsp)) best = g;
+        }
+        Lane_Group w = b->waiting[best];
+        b->waiting[best] = b->waiting[--b->num_waiting];
+        b->active = 0;
+        for (int l = 0; l < b->nlanes; l++) {
+            bool in = !b->lane_done[l] && b->lane_ip[l] == w.ip && b->lane_sp[l] == w.sp && b->lane_callsp[l] == w.callsp;
+            b->mask[l] = in ? -1 : 0;
+            b->active += in;
+        }
+        if (b->active > 0) {
+            b->ip = w.ip;
+            b->sp = w.sp;
+            b->callsp = w.callsp;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Pull in a waiting group that has caught up with the running one */
+static void merge(VM_Batch *b) {
+    int g = find_group(b, b->ip, b->sp, b->callsp);
+    if (g < 0) return;
+    b->waiting[g] = b->waiting[--b->num_waiting];
+    for (int l = 0; l < b->nlanes; l++) {
+        if (!b->mask[l] && !b->lane_done[l] && b->lane_ip[l] == b->ip &&
+            b->lane_sp[l] == b->sp && b->lane_callsp[l] == b->callsp) {
+            b->mask[l] = -1;
+            b->active++;
+        }
+    }
+}
+
+/* After a jump, let a waiting group that should run first go ahead */
+static bool outranked(VM_Batch *b) {
+    for (int g = 0; g < b->num_waiting; g++) {
+        if (runs_before(&b->waiting[g], b->ip, b->callsp)) return true;
+    }
+    return false;
+}
+
+/* lane_ip holds each running lane's next ip; true if they don't all agree */
+static bool diverged(VM_Batch *b) {
+    addr32 first = NO_ADDR;
+    for (int l = 0; l < b->nlanes; l++) {
+        if (!b->mask[l]) continue;
+        if (first == NO_ADDR) first = b->lane_ip[l];
+        else if (b->lane_ip[l] != first) return true;
+    }
+    b->ip = first;
+    return false;
+}
+
+VM_Batch *vm_batch_alloc(VM *program, int ninstances) {
+    vm_load_rest(program); // lanes run the code directly, no decode on CALL
+    VM_Batch *b = calloc(1, sizeof(VM_Batch));
+    if (b == NULL) return NULL;
+    int n = (ninstances + BATCH_LANE_ALIGN - 1) / BATCH_LANE_ALIGN * BATCH_LANE_ALIGN;
+    b->program = program;
+    b->ninstances = ninstances;
+    b->nlanes = n;
+    b->mask = calloc((size_t)n, sizeof(int32_t));
+    b->lane_ip = calloc((size_t)n, sizeof(addr32));
+    b->lane_sp = calloc((size_t)n, sizeof(int));
+    b->lane_callsp = calloc((size_t)n, sizeof(int));
+    b->lane_done = calloc((size_t)n, sizeof(bool));
+    b->waiting = calloc((size_t)n + 1, sizeof(Lane_Group));
+    // big but mostly untouched; calloc gets these straight from mmap
+    b->ival = calloc((size_t)MAX_OPND_STACK * n, sizeof(int32_t));
+    b->type = calloc((size_t)MAX_OPND_STACK * n, sizeof(byte));
+    b->sval = calloc((size_t)MAX_OPND_STACK * n, sizeof(String *));
+    b->local_ival = calloc((size_t)MAX_CALL_STACK * MAX_LOCALS * n, sizeof(int32_t));
+    b->local_type = calloc((size_t)MAX_CALL_STACK * MAX_LOCALS * n, sizeof(byte));
+    b->local_sval = calloc((size_t)MAX_CALL_STACK * MAX_LOCALS * n, sizeof(String *));
+    b->retaddr = calloc((size_t)MAX_CALL_STACK * n, sizeof(addr32));
+    b->output = calloc((size_t)n, sizeof(char *));
+    b->output_len = calloc((size_t)n, sizeof(size_t));
+    b->output_cap = calloc((size_t)n, sizeof(size_t));
+    if (b->mask == NULL || b->lane_ip == NULL || b->lane_sp == NULL || b->lane_callsp == NULL ||
+        b->lane_done == NULL || b->waiting == NULL || b->ival == NULL || b->type == NULL ||
+        b->sval == NULL || b->local_ival == NULL || b->local_type == NULL || b->local_sval == NULL ||
+        b->retaddr == NULL || b->output == NULL || b->output_len == NULL || b->output_cap == NULL) {
+        vm_batch_free(b);
+        return NULL;
+    }
+
+    addr32 main = vm_function(program, "main");
+    for (int l = 0; l < n; l++) {
+        b->lane_ip[l] = main;
+        b->lane_sp[l] = -1;
+        b->lane_callsp[l] = 0;
+        b->lane_done[l] = l >= ninstances; // padding lanes never run
+        lane_print(b, l, "");
+    }
+    add_group(b, main, -1, 0);
+    return b;
+}
+
+/* Pass args to one instance's main, as if main had been called with them */
+void vm_batch_input(VM_Batch *b, int instance, int nargs, const int *args) {
+    for (int i = 0; i < nargs && i < MAX_LOCALS; i++) {
+        b->local_ival[FRAME_ROW(b, 0, i) + instance] = args[i];
+        b->local_type[FRAME_ROW(b, 0, i) + instance] = INT;
+    }
+}
+
+/* Run every instance to HALT; false if the program uses an opcode we can't batch */
+bool vm_batch_exec(VM_Batch *b) {
+    byte *code = b->program->code;
+    int n = b->nlanes;
+    int l;
+    allocator_use(b->program->heap); // lane Strings go away with the program
+    while (resume(b)) {
+        for (;;) {
+            if (b->num_waiting > 0) merge(b);
+            if (b->ip >= (addr32)b->program->code_size || code[b->ip] == HALT) {
+                for (l = 0; l < n; l++) {
+                    if (b->mask[l]) b->lane_done[l] = true;
+                }
+                break;
+            }
+            byte opcode = code[b->ip];
+            addr32 next = b->ip + vm_instr_size(opcode);
+            int32_t opnd = 0;
+            if (vm_instructions[opcode].opnd_sizes[0] == 4) opnd = *((int32_t *)&code[b->ip + 1]);
+            else if (vm_instructions[opcode].opnd_sizes[0] == 2) opnd = *((int16_t *)&code[b->ip + 1]);
+            b->steps++;
+            b->lane_instrs += b->active;
+
+            int32_t *top_i = &b->ival[ROW(b, b->sp)];
+            int32_t *below_i = &b->ival[ROW(b, b->sp - 1)];
+            byte *below_t = &b->type[ROW(b, b->sp - 1)];
+            String **top_s = &b->sval[ROW(b, b->sp)];
+            String **below_s = &b->sval[ROW(b, b->sp - 1)];
+            char buf[50];
+            b->ip = next;
+            switch (opcode) {
+                case IADD: lanes_binop(LANE_ADD, below_i, top_i, b->mask, n); b->sp--; break;
+                case ISUB: lanes_binop(LANE_SUB, below_i, top_i, b->mask, n); b->sp--; break;
+                case IMUL: lanes_binop(LANE_MUL, below_i, top_i, b->mask, n); b->sp--; break;
+                case IDIV:
+                    for (l = 0; l < n; l++) {
+                        if (b->mask[l]) below_i[l] = below_i[l] / top_i[l];
+                    }
+                    b->sp--;
+                    break;
+                case OR:
+                case AND:
+                case IEQ:
+                case INEQ:
+                case ILT:
+                case ILE:
+                case IGT:
+                case IGE: {
+                    static const Lane_Op ops[] = {
+                        [OR] = LANE_OR, [AND] = LANE_AND, [IEQ] = LANE_EQ, [INEQ] = LANE_NEQ,
+                        [ILT] = LANE_LT, [ILE] = LANE_LE, [IGT] = LANE_GT, [IGE] = LANE_GE
+                    };
+                    lanes_binop(ops[opcode], below_i, top_i, b->mask, n);
+                    lanes_set_type(below_t, BOOLEAN, b->mask, n);
+                    b->sp--;
+                    break;
+                }
+                case INEG:
+                case NOT:
+                    lanes_unop(opcode == INEG, top_i, b->mask, n);
+                    lanes_set_type(&b->type[ROW(b, b->sp)], opcode == INEG ? INT : BOOLEAN, b->mask, n);
+                    break;
+                case ICONST:
+                    b->sp++;
+                    lanes_fill(&b->ival[ROW(b, b->sp)], opnd, b->mask, n);
+                    lanes_set_type(&b->type[ROW(b, b->sp)], INT, b->mask, n);
+                    break;
+                case SCONST:
+                    b->sp++;
+                    for (l = 0; l < n; l++) {
+                        if (!b->mask[l]) continue;
+                        b->sval[ROW(b, b->sp) + l] = String_new(b->program->strings[opnd]->str);
+                        b->type[ROW(b, b->sp) + l] = STRING;
+                    }
+                    break;
+                case LOAD:
+                    b->sp++;
+                    lanes_move(b, &b->ival[ROW(b, b->sp)], &b->type[ROW(b, b->sp)], &b->sval[ROW(b, b->sp)],
+                               &b->local_ival[FRAME_ROW(b, b->callsp, opnd)], &b->local_type[FRAME_ROW(b, b->callsp, opnd)],
+                               &b->local_sval[FRAME_ROW(b, b->callsp, opnd)]);
+                    break;
+                case STORE:
+                    lanes_move(b, &b->local_ival[FRAME_ROW(b, b->callsp, opnd)], &b->local_type[FRAME_ROW(b, b->callsp, opnd)],
+                               &b->local_sval[FRAME_ROW(b, b->callsp, opnd)],
+                               top_i, &b->type[ROW(b, b->sp)], top_s);
+                    b->sp--;
+                    break;
+                case SFREE:
+                    for (l = 0; l < n; l++) {
+                        if (!b->mask[l]) continue;
+                        String_free(b->local_sval[FRAME_ROW(b, b->callsp, opnd) + l]);
+                        b->local_sval[FRAME_ROW(b, b->callsp, opnd) + l] = NULL;
+                        b->local_type[FRAME_ROW(b, b->callsp, opnd) + l] = INVALID;
+                    }
+                    break;
+                case LOCALS:
+                    break; // frame sizes only matter for traces
+                case POP:
+                    b->sp--;
+                    break;
+                case PRINT:
+                    for (l = 0; l < n; l++) {
+                        if (!b->mask[l]) continue;
+                        switch (b->type[ROW(b, b->sp) + l]) {
+                            case INT: sprintf(buf, "%d", top_i[l]); lane_print(b, l, buf); break;
+                            case BOOLEAN: lane_print(b, l, top_i[l] ? "true" : "false"); break;
+                            case STRING: lane_print(b, l, top_s[l]->str); break;
+                            default: lane_print(b, l, "?"); break;
+                        }
+                        lane_print(b, l, "\n");
+                    }
+                    b->sp--;
+                    break;
+                case SADD:
+                    for (l = 0; l < n; l++) {
+                        if (b->mask[l]) below_s[l] = String_add(below_s[l], top_s[l]);
+                    }
+                    b->sp--;
+                    break;
+                case I2S:
+                    for (l = 0; l < n; l++) {
+                        if (!b->mask[l]) continue;
+                        top_s[l] = String_from_int(top_i[l]);
+                        b->type[ROW(b, b->sp) + l] = STRING;
+                    }
+                    break;
+                case SLEN:
+                    for (l = 0; l < n; l++) {
+                        if (!b->mask[l]) continue;
+                        top_i[l] = (int32_t)strlen(top_s[l]->str);
+                        b->type[ROW(b, b->sp) + l] = INT;
+                    }
+                    break;
+                case SEQ:
+                case SNEQ:
+                case SGT:
+                case SGE:
+                case SLT:
+                case SLE:
+                    for (l = 0; l < n; l++) {
+                        if (!b->mask[l]) continue;
+                        int c = strcmp(below_s[l]->str, top_s[l]->str);
+                        below_i[l] = opcode == SEQ ? c == 0 : opcode == SNEQ ? c != 0 :
+                                     opcode == SGT ? c > 0 : opcode == SGE ? c >= 0 :
+                                     opcode == SLT ? c < 0 : c <= 0;
+                        below_t[l] = BOOLEAN;
+                    }
+                    b->sp--;
+                    break;
+                case SINDEX:
+                    for (l = 0; l < n; l++) {
+                        if (!b->mask[l]) continue;
+                        below_s[l] = String_from_char(below_s[l]->str[top_i[l] - 1]);
+                        below_t[l] = STRING;
+                    }
+                    b->sp--;
+                    break;
+                case SSUBSTR: { // s, i, n
+                    String **s = &b->sval[ROW(b, b->sp - 2)];
+                    for (l = 0; l < n; l++) {
+                        if (b->mask[l]) s[l] = String_substr(s[l], below_i[l], top_i[l]);
+                    }
+                    b->sp -= 2;
+                    break;
+                }
+                case SFIND:
+                case SPREFIX:
+                case SSUFFIX:
+                    for (l = 0; l < n; l++) {
+                        if (!b->mask[l]) continue;
+                        below_i[l] = opcode == SFIND ? String_find(below_s[l], top_s[l]) :
+                                     opcode == SPREFIX ? String_prefix(below_s[l], top_s[l]) :
+                                     String_suffix(below_s[l], top_s[l]);
+                        below_t[l] = opcode == SFIND ? INT : BOOLEAN;
+                    }
+                    b->sp--;
+                    break;
+                case SREPEAT:
+                    for (l = 0; l < n; l++) {
+                        if (b->mask[l]) below_s[l] = String_repeat(below_s[l], top_i[l]);
+                    }
+                    b->sp--;
+                    break;
+                case SUPPER:
+                case SLOWER:
+                    for (l = 0; l < n; l++) {
+                        if (!b->mask[l]) continue;
+                        top_s[l] = opcode == SUPPER ? String_upper(top_s[l]) : String_lower(top_s[l]);
+                    }
+                    break;
+                case BR:
+                    b->ip = (addr32)opnd;
+                    if (outranked(b)) {
+                        suspend(b, true);
+                        goto next_group;
+                    }
+                    break;
+                case BRF:
+                    for (l = 0; l < n; l++) {
+                        if (b->mask[l]) b->lane_ip[l] = top_i[l] ? next : (addr32)opnd;
+                    }
+                    b->sp--;
+                    if (diverged(b) || outranked(b)) {
+                        suspend(b, false);
+                        goto next_group;
+                    }
+                    break;
+                case CALL: {
+                    int nargs = *((int16_t *)&code[b->ip - 2]);
+                    int d = ++b->callsp;
+                    for (int g = nargs - 1; g >= 0; g--) {
+                        lanes_move(b, &b->local_ival[FRAME_ROW(b, d, g)], &b->local_type[FRAME_ROW(b, d, g)],
+                                   &b->local_sval[FRAME_ROW(b, d, g)],
+                                   &b->ival[ROW(b, b->sp)], &b->type[ROW(b, b->sp)], &b->sval[ROW(b, b->sp)]);
+                        b->sp--;
+                    }
+                    for (l = 0; l < n; l++) {
+                        if (b->mask[l]) b->retaddr[d * n + l] = b->ip;
+                    }
+                    b->ip = (addr32)opnd;
+                    if (outranked(b)) {
+                        suspend(b, true);
+                        goto next_group;
+                    }
+                    break;
+                }
+                case RET:
+                    for (l = 0; l < n; l++) {
+                        if (b->mask[l]) b->lane_ip[l] = b->retaddr[b->callsp * n + l];
+                    }
+                    b->callsp--;
+                    if (diverged(b) || outranked(b)) {
+                        suspend(b, false);
+                        goto next_group;
+                    }
+                    break;
+                case CALLNATIVE: { // per lane, through elements
+                    Native *nf = &vm_natives[opnd];
+                    int base = b->sp - nf->nargs + 1;
+                    for (l = 0; l < n; l++) {
+                        if (!b->mask[l]) continue;
+                        element args[MAX_NATIVE_ARGS];
+                        for (int a = 0; a < nf->nargs; a++) {
+                            args[a].type = (element_type)b->type[ROW(b, base + a) + l];
+                            if (args[a].type == STRING) args[a].s = b->sval[ROW(b, base + a) + l];
+                            else if (args[a].type == BOOLEAN) args[a].b = b->ival[ROW(b, base + a) + l] != 0;
+                            else args[a].i = b->ival[ROW(b, base + a) + l];
+                            if (args[a].type != nf->arg_types[a]) {
+                                fprintf(stderr, "batch: native %s: arg %d has wrong type\n", nf->name, a + 1);
+                                return false;
+                            }
+                        }
+                        element r = nf->fn(b->program, args);
+                        b->type[ROW(b, base) + l] = (byte)r.type;
+                        if (r.type == STRING) b->sval[ROW(b, base) + l] = r.s;
+                        else if (r.type == BOOLEAN) b->ival[ROW(b, base) + l] = r.b;
+                        else b->ival[ROW(b, base) + l] = r.i;
+                    }
+                    b->sp = base - (nf->result != INVALID ? 0 : 1);
+                    break;
+                }
+                default:
+                    fprintf(stderr, "batch: can't run opcode %s at ip=%d\n", vm_instructions[opcode].name, b->ip - vm_instr_size(opcode));
+                    return false;
+            }
+        }
+        next_group: ;
+    }
+    return true;
+}
+
+void vm_batch_free(VM_Batch *b) {
+    for (int l = 0; b->output != NULL && l < b->nlanes; l++) free(b->output[l]);
+    free(b->output);
+    free(b->output_len);
+    free(b->output_cap);
+    free(b->mask);
+    free(b->lane_ip);
+    free(b->lane_sp);
+    free(b->lane_callsp);
+    free(b->lane_done);
+    free(b->waiting);
+    free(b->ival);
+    free(b->type);
+    free(b->sval);
+    free(b->local_ival);
+    free(b->local_type);
+    free(b->local_sval);
+    free(b->retaddr);
+    free(b);
+}
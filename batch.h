@@ -0,0 +1,83 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "vm.h"
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+static const int BATCH_LANE_ALIGN = 8; // lanes are padded to a multiple of this
+
+typedef struct {
+	addr32 ip;
+	int sp;
+	int callsp;
+} Lane_Group;
+
+/* One program run over many instances at once, one SIMD lane per instance.
+ * Lanes at the same ip/sp/callsp form a group that executes together; the
+ * running group's registers live in ip/sp/callsp and the others wait in
+ * waiting[] with their registers in the lane_* arrays.
+ */
+typedef struct {
+	VM *program;		// code, strings and function names only; never executed
+	int ninstances;
+	int nlanes;			// ninstances padded to BATCH_LANE_ALIGN
+
+	addr32 ip;			// registers of the running group
+	int sp;
+	int callsp;
+	int32_t *mask;		// -1 for lanes in the running group, else 0
+	int active;			// lanes in mask
+
+	addr32 *lane_ip;
+	int *lane_sp;
+	int *lane_callsp;
+	bool *lane_done;
+	Lane_Group *waiting;
+	int num_waiting;
+
+	// operand stack slot i of lane l is at [i * nlanes + l]
+	int32_t *ival;		// INT and BOOLEAN values
+	byte *type;
+	String **sval;
+	// slot j of frame d for lane l is at [(d * MAX_LOCALS + j) * nlanes + l]
+	int32_t *local_ival;
+	byte *local_type;
+	String **local_sval;
+	addr32 *retaddr;	// [d * nlanes + l]
+
+	char **output;		// per instance, what PRINT wrote
+	size_t *output_len;
+	size_t *output_cap;
+
+	unsigned long steps;		// instrs dispatched, one per group
+	unsigned long lane_instrs;	// instrs executed summed over lanes
+} VM_Batch;
+
+extern VM_Batch *vm_batch_alloc(VM *program, int ninstances); // NULL if out of memory
+extern void vm_batch_input(VM_Batch *b, int instance, int nargs, const int *args);
+extern bool vm_batch_exec(VM_Batch *b);
+extern void vm_batch_free(VM_Batch *b);
+
+#endif
@@ -0,0 +1,198 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "vm.h"
+#include "loader.h"
+#include "optimizer.h"
+#include "checkpoint.h"
+#include "natives.h"
+#include "cache.h"
+
+/*
+A content-addressed cache of loaded (and optionally optimized) programs.
+
+The key hashes the .bytecode text together with everything that changes
+what vm_load produces from it: cache and snapshot versions, the opcode
+count, the native table (CALLNATIVE operands are indexes into it) and
+whether the optimizer ran. An image is just a snapshot of the VM before
+vm_start, so a hit is vm_restore: one mmap and a few memcpys instead of
+parsing text. Each image is tagged with a second, unrelated hash of the
+source, and a hit must match it too. Then a key collision or a file
+that's been swapped in under the wrong name gets rebuilt, not run.
+
+Images are written to a temp file and renamed into place so concurrent
+readers see a whole image or none; two processes missing at once both
+write the same bytes and the last rename wins. A hit bumps the image's
+mtime, and whoever adds an image evicts the least recently used ones
+past max_bytes while holding an flock on dir/.lock. Temp files count
+toward max_bytes too; one older than CACHE_TEMP_MAX_AGE belongs to a
+writer that died before its rename and is deleted.
+ */
+
+static unsigned long long fnv64(unsigned long long h, const void *data, size_t n) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static unsigned long long cache_key(const char *source, size_t n, bool optimize) {
+    int versions[] = {CACHE_VERSION, SNAPSHOT_VERSION, NUM_INSTRS, optimize};
+    unsigned long long h = 14695981039346656037ULL;
+    h = fnv64(h, versions, sizeof(versions));
+    for (int i = 0; i < vm_num_natives; i++) {
+        h = fnv64(h, vm_natives[i].name, strlen(vm_natives[i].name) + 1);
+    }
+    return fnv64(h, source, n);
+}
+
+static unsigned long long source_hash(const char *source, size_t n) {
+    unsigned long long h = 5381 + n;
+    for (size_t i = 0; i < n; i++) {
+        h = (h << 5) + h + (unsigned char)source[i]; // djb2, not FNV like the key
+    }
+    return h;
+}
+
+static char *read_file(const char *path, size_t *n) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+    size_t capacity = 4096;
+    char *data = malloc(capacity);
+    *n = 0;
+    size_t got;
+    while ((got = fread(&data[*n], 1, capacity - *n, f)) > 0) {
+        *n += got;
+        if (*n == capacity) data = realloc(data, capacity *= 2);
+    }
+    fclose(f);
+    return data;
+}
+
+typedef struct {
+    char *name;
+    time_t mtime;
+    off_t size;
+} Cache_Entry;
+
+static int by_age(const void *a, const void *b) {
+    const Cache_Entry *x = a, *y = b;
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime ? 1 : 0;
+}
+
+/* Delete the least recently used images until the cache fits in max_bytes,
+ * and any temp image that's been abandoned
+ */
+static void evict(const char *dir, long max_bytes) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/.lock", dir);
+    int lock = open(path, O_RDWR | O_CREAT, 0644);
+    if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+        if (lock >= 0) close(lock);
+        return;
+    }
+    DIR *d = opendir(dir);
+    if (d != NULL) {
+        int n = 0, capacity = 64;
+        long total = 0;
+        Cache_Entry *entries = malloc(capacity * sizeof(Cache_Entry));
+        struct dirent *e;
+        time_t now = time(NULL);
+        while ((e = readdir(d)) != NULL) {
+            size_t len = strlen(e->d_name);
+            struct stat st;
+            bool temp = strstr(e->d_name, ".vmimg.") != NULL; // vm_checkpoint's mkstemp name
+            if (!temp && (len < 6 || strcmp(&e->d_name[len - 6], ".vmimg") != 0)) continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            if (stat(path, &st) != 0) continue;
+            if (temp) { // a live writer's is counted but left alone
+                if (now - st.st_mtime > CACHE_TEMP_MAX_AGE) unlink(path);
+                else total += st.st_size;
+                continue;
+            }
+            if (n == capacity) entries = realloc(entries, (capacity *= 2) * sizeof(Cache_Entry));
+            entries[n].name = strdup(e->d_name);
+            entries[n].mtime = st.st_mtime;
+            entries[n].size = st.st_size;
+            total += st.st_size;
+            n++;
+        }
+        closedir(d);
+        qsort(entries, (size_t)n, sizeof(Cache_Entry), by_age);
+        for (int i = 0; i < n; i++) {
+            if (total > max_bytes) {
+                snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+                if (unlink(path) == 0) total -= entries[i].size;
+            }
+            free(entries[i].name);
+        }
+        free(entries);
+    }
+    flock(lock, LOCK_UN);
+    close(lock);
+}
+
+/*
+Load the program in path through the cache in dir, creating dir if need
+be. Returns a VM ready for vm_exec, or NULL if path can't be read. Any
+problem with the cache itself just falls back to loading path.
+ */
+VM *vm_cache_load(const char *dir, const char *path, bool optimize, long max_bytes) {
+    size_t n;
+    char *source = read_file(path, &n);
+    if (source == NULL) return NULL;
+    vm_natives_init(); // the key depends on the native table
+    char image[4096];
+    snprintf(image, sizeof(image), "%s/%016llx.vmimg", dir, cache_key(source, n, optimize));
+
+    unsigned long long check = source_hash(source, n);
+
+    // just try it; it may be evicted between any check and the open
+    VM *vm = vm_restore_tagged(image, check);
+    if (vm != NULL) {
+        utimensat(AT_FDCWD, image, NULL, 0); // most recently used
+        free(source);
+        return vm;
+    }
+
+    // missing, corrupt or another program's: build it and rename over whatever is there
+    FILE *f = fmemopen(source, n, "r");
+    vm = vm_load(f);
+    fclose(f);
+    free(source);
+    if (vm == NULL) return NULL;
+    if (optimize) vm_optimize(vm);
+    mkdir(dir, 0755);
+    if (vm_checkpoint_tagged(vm, image, check)) evict(dir, max_bytes);
+    return vm;
+}
@@ -0,0 +1,458 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vm.h"
+#include "loader.h"
+#include "checkpoint.h"
+
+/*
+A snapshot is the code image plus all machine state, so a VM that did a
+long setup phase can be saved once and restored by many later processes.
+All ints are 32 bits in native byte order:
+
+	magic[8] version tag_lo tag_hi          tag is the writer's check value, 0 from -checkpoint
+	ip sp callsp code_size num_functions max_func_addr num_strings num_objects
+	code_size bytes of code
+	num_functions x (addr len name)
+	num_strings x (len chars)               string pool used by SCONST
+	num_objects x (type len payload)        live Strings/Arrays on stack/in frames;
+	                                        payload is len chars or len int32s
+	sp+1 x element                          operand stack
+	callsp+1 x (retaddr len name nargs nlocals nargs+nlocals x element)
+	len output
+	has_origins [code_size x origin func addr or -1]
+
+An element is (type value); for STRING and ARRAY the value indexes the
+object table so objects shared between slots are still shared after a
+restore. That matters more for Arrays since ASTORE writes through them.
+ */
+
+typedef struct {
+    void **keys;
+    int *vals;
+    int capacity;       // power of 2
+    element *objects;   // in index order
+    int count;
+} Object_Table;
+
+typedef struct {
+    const byte *p;
+    const byte *end;
+    bool ok;
+} Reader;
+
+static bool is_object(element el) {
+    return el.type == STRING || el.type == ARRAY;
+}
+
+static int object_index(Object_Table *t, element el, bool add) {
+    void *s = el.type == ARRAY ? (void *)el.a : (void *)el.s;
+    if (s == NULL) return -1;
+    unsigned int h = (unsigned int)(((uintptr_t)s >> 4) * 2654435761u) & (t->capacity - 1);
+    while (t->keys[h] != NULL) {
+        if (t->keys[h] == s) return t->vals[h];
+        h = (h + 1) & (t->capacity - 1);
+    }
+    if (!add) return -1;
+    t->keys[h] = s;
+    t->vals[h] = t->count;
+    t->objects[t->count] = el;
+    return t->count++;
+}
+
+static void collect_objects(VM *vm, Object_Table *t) {
+    int max = vm->sp + 1 + (vm->callsp + 1) * MAX_LOCALS;
+    t->capacity = 16;
+    while (t->capacity < max * 2) t->capacity *= 2;
+    t->keys = calloc((size_t)t->capacity, sizeof(void *));
+    t->vals = calloc((size_t)t->capacity, sizeof(int));
+    t->objects = calloc((size_t)max + 1, sizeof(element));
+    for (int i = 0; i <= vm->sp; i++) {
+        if (is_object(vm->stack[i])) object_index(t, vm->stack[i], true);
+    }
+    for (int i = 0; i <= vm->callsp; i++) {
+        Activation_Record *frame = &vm->call_stack[i];
+        for (int j = 0; j < frame->nargs + frame->nlocals && j < MAX_LOCALS; j++) {
+            if (is_object(frame->locals[j])) object_index(t, frame->locals[j], true);
+        }
+    }
+}
+
+static void write32(FILE *f, int n) {
+    int32_t v = (int32_t)n;
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void write_chars(FILE *f, const char *s) {
+    size_t len = strlen(s);
+    write32(f, (int)len);
+    fwrite(s, 1, len, f);
+}
+
+static void write_object(FILE *f, element el) {
+    write32(f, el.type);
+    if (el.type == STRING) write_chars(f, el.s->str);
+    else {
+        write32(f, (int)el.a->length);
+        fwrite(el.a->data, sizeof(int32_t), el.a->length, f);
+    }
+}
+
+static void write_element(FILE *f, Object_Table *t, element el) {
+    write32(f, el.type);
+    switch (el.type) {
+        case INT:
+            write32(f, el.i);
+            break;
+        case BOOLEAN:
+            write32(f, el.b);
+            break;
+        case STRING:
+        case ARRAY:
+            write32(f, object_index(t, el, false));
+            break;
+        default:
+            write32(f, 0);
+            break;
+    }
+}
+
+/* Save vm to path; written to a temp file and renamed so readers never see half a snapshot */
+bool vm_checkpoint(VM *vm, const char *path) {
+    return vm_checkpoint_tagged(vm, path, 0);
+}
+
+/* vm_checkpoint with a value vm_restore_tagged must be given to get it back */
+bool vm_checkpoint_tagged(VM *vm, const char *path, uint64_t tag) {
+    vm_load_rest(vm); // a snapshot holds all the code
+    for (int i = 0; i <= vm->callsp; i++) {
+        if (vm->call_stack[i].name == NULL) { // restore finds frames' functions by name
+            fprintf(stderr, "can't snapshot frame %d; it isn't in a named function\n", i);
+            return false;
+        }
+    }
+    char tmp[strlen(path) + 16];
+    sprintf(tmp, "%s.XXXXXX", path); // unique per writer, threads included
+    int fd = mkstemp(tmp);
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (f == NULL) {
+        fprintf(stderr, "can't write snapshot %s\n", tmp);
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return false;
+    }
+    fchmod(fd, 0644); // mkstemp makes it 0600
+    Object_Table objects = {0};
+    collect_objects(vm, &objects);
+
+    fwrite(SNAPSHOT_MAGIC, 1, 8, f);
+    write32(f, SNAPSHOT_VERSION);
+    write32(f, (int)(uint32_t)tag);
+    write32(f, (int)(uint32_t)(tag >> 32));
+    write32(f, (int)vm->ip);
+    write32(f, vm->sp);
+    write32(f, vm->callsp);
+    write32(f, vm->code_size);
+    write32(f, vm->num_functions);
+    write32(f, vm->max_func_addr);
+    write32(f, vm->num_strings);
+    write32(f, objects.count);
+    fwrite(vm->code, 1, (size_t)vm->code_size, f);
+    for (int a = 0; vm->func_names != NULL && a <= vm->max_func_addr; a++) {
+        if (vm->func_names[a] != NULL) {
+            write32(f, a);
+            write_chars(f, vm->func_names[a]);
+        }
+    }
+    for (int i = 0; i < vm->num_strings; i++) {
+        write_chars(f, vm->strings[i]->str);
+    }
+    for (int i = 0; i < objects.count; i++) {
+        write_object(f, objects.objects[i]);
+    }
+    for (int i = 0; i <= vm->sp; i++) {
+        write_element(f, &objects, vm->stack[i]);
+    }
+    for (int i = 0; i <= vm->callsp; i++) {
+        Activation_Record *frame = &vm->call_stack[i];
+        int nslots = frame->nargs + frame->nlocals;
+        if (nslots > MAX_LOCALS) nslots = MAX_LOCALS;
+        write32(f, (int)frame->retaddr);
+        write_chars(f, frame->name);
+        write32(f, frame->nargs);
+        write32(f, frame->nlocals);
+        for (int j = 0; j < nslots; j++) {
+            write_element(f, &objects, frame->locals[j]);
+        }
+    }
+    write_chars(f, vm->output);
+    write32(f, vm->inlined_from != NULL);
+    char *last_origin = NULL;
+    int last_addr = -1;
+    for (int i = 0; vm->inlined_from != NULL && i < vm->code_size; i++) {
+        char *origin = vm->inlined_from[i];
+        if (origin != NULL && origin != last_origin) { // runs of inlined code share an origin
+            last_origin = origin;
+            last_addr = (int)vm_function(vm, origin);
+        }
+        write32(f, origin != NULL ? last_addr : -1);
+    }
+
+    free(objects.keys);
+    free(objects.vals);
+    free(objects.objects);
+    bool ok = !ferror(f);
+    if (fclose(f) != 0) ok = false;
+    if (ok && rename(tmp, path) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "can't write snapshot %s\n", path);
+        unlink(tmp);
+    }
+    return ok;
+}
+
+static int read32(Reader *r) {
+    int32_t v = 0;
+    if (r->end - r->p < (long)sizeof(v)) {
+        r->ok = false;
+        return 0;
+    }
+    memcpy(&v, r->p, sizeof(v));
+    r->p += sizeof(v);
+    return v;
+}
+
+static const byte *read_bytes(Reader *r, int n) {
+    if (n < 0 || r->end - r->p < n) {
+        r->ok = false;
+        return NULL;
+    }
+    const byte *data = r->p;
+    r->p += n;
+    return data;
+}
+
+static String *read_string(Reader *r) {
+    int len = read32(r);
+    const byte *data = read_bytes(r, len);
+    if (data == NULL) return NULL;
+    String *s = String_alloc((size_t)len);
+    memcpy(s->str, data, (size_t)len);
+    return s;
+}
+
+static element read_object(Reader *r) {
+    element el = {0};
+    el.type = (element_type)read32(r);
+    if (el.type == STRING) el.s = read_string(r);
+    else if (el.type == ARRAY) {
+        int len = read32(r);
+        bool fits = len >= 0 && len <= (r->end - r->p) / (long)sizeof(int32_t); // len * 4 can't overflow
+        const byte *data = fits ? read_bytes(r, len * (int)sizeof(int32_t)) : NULL;
+        if (data != NULL) el.a = Array_alloc((size_t)len);
+        if (el.a == NULL) r->ok = false;
+        else {
+            memcpy(el.a->data, data, (size_t)len * sizeof(int32_t));
+        }
+    }
+    else r->ok = false;
+    if (!r->ok) el.type = INVALID;
+    return el;
+}
+
+static element read_element(Reader *r, element *objects, int num_objects) {
+    element el = {0};
+    el.type = (element_type)read32(r);
+    int v = read32(r);
+    switch (el.type) {
+        case INT:
+            el.i = v;
+            break;
+        case BOOLEAN:
+            el.b = v != 0;
+            break;
+        case STRING:
+        case ARRAY:
+            if (v >= num_objects || (v >= 0 && objects[v].type != el.type)) r->ok = false;
+            else if (v >= 0) el = objects[v];
+            else el.s = NULL;
+            break;
+        default:
+            el.type = INVALID;
+            break;
+    }
+    return el;
+}
+
+/* Load path, checking its tag if tag isn't NULL. A missing file or another
+ * tag is only reported if loud; a caching caller just builds the VM instead.
+ */
+static VM *restore(const char *path, const uint64_t *tag, bool loud) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (loud) fprintf(stderr, "can't open snapshot %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 8) {
+        fprintf(stderr, "bad snapshot %s\n", path);
+        close(fd);
+        return NULL;
+    }
+    byte *image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "can't map snapshot %s\n", path);
+        return NULL;
+    }
+    Reader r = {image + 8, image + st.st_size, true};
+    if (memcmp(image, SNAPSHOT_MAGIC, 8) != 0 || read32(&r) != SNAPSHOT_VERSION) {
+        fprintf(stderr, "%s is not a version %d snapshot\n", path, SNAPSHOT_VERSION);
+        munmap(image, (size_t)st.st_size);
+        return NULL;
+    }
+    uint64_t stored = (uint32_t)read32(&r);
+    stored |= (uint64_t)(uint32_t)read32(&r) << 32;
+    if (tag != NULL && stored != *tag) {
+        if (loud) fprintf(stderr, "snapshot %s has tag %016llx, not %016llx\n", path,
+                          (unsigned long long)stored, (unsigned long long)*tag);
+        munmap(image, (size_t)st.st_size);
+        return NULL;
+    }
+
+    VM *vm = vm_alloc();
+    if (vm == NULL) {
+        munmap(image, (size_t)st.st_size);
+        return NULL;
+    }
+    allocator_use(vm->heap);
+    addr32 ip = (addr32)read32(&r);
+    int sp = read32(&r);
+    int callsp = read32(&r);
+    int code_size = read32(&r);
+    vm->num_functions = read32(&r);
+    vm->max_func_addr = read32(&r);
+    vm->num_strings = read32(&r);
+    int num_objects = read32(&r);
+    if (!r.ok || code_size < 0 || vm->num_functions < 0 || vm->max_func_addr < 0 || vm->num_strings < 0 ||
+        num_objects < 0 || sp < -1 || sp >= MAX_OPND_STACK_GROWN || callsp < -1 || callsp >= MAX_CALL_STACK_GROWN ||
+        !vm_stack_reserve(vm, sp, callsp)) {
+        r.ok = false;
+        vm->num_functions = vm->max_func_addr = vm->num_strings = num_objects = 0;
+        sp = callsp = -1;
+        code_size = 0;
+    }
+
+    byte *code = calloc((size_t)code_size + 1, 1);
+    const byte *data = read_bytes(&r, code_size);
+    if (data != NULL) memcpy(code, data, (size_t)code_size);
+    vm_init(vm, code, code_size);
+
+    vm->func_names = calloc((size_t)vm->max_func_addr + 1, sizeof(char *));
+    for (int i = 0; r.ok && i < vm->num_functions; i++) {
+        int a = read32(&r);
+        String *name = read_string(&r);
+        if (name == NULL || a < 0 || a > vm->max_func_addr) {
+            String_free(name);
+            r.ok = false;
+            break;
+        }
+        vm->func_names[a] = strdup(name->str);
+        String_free(name);
+    }
+    vm->strings = calloc((size_t)vm->num_strings + 1, sizeof(String *));
+    for (int i = 0; r.ok && i < vm->num_strings; i++) {
+        vm->strings[i] = read_string(&r);
+    }
+    element *objects = calloc((size_t)num_objects + 1, sizeof(element));
+    for (int i = 0; r.ok && i < num_objects; i++) {
+        objects[i] = read_object(&r);
+    }
+
+    for (int i = 0; r.ok && i <= sp; i++) {
+        vm->stack[i] = read_element(&r, objects, num_objects);
+    }
+    vm->sp = sp;
+    for (int i = 0; r.ok && i <= callsp; i++) {
+        Activation_Record *frame = &vm->call_stack[i];
+        frame->retaddr = (addr32)read32(&r);
+        String *name = read_string(&r);
+        frame->nargs = read32(&r);
+        frame->nlocals = read32(&r);
+        if (name == NULL) break;
+        addr32 a = vm_function(vm, name->str);
+        if (a == NO_ADDR) {
+            fprintf(stderr, "snapshot %s has a frame in unknown function %s\n", path, name->str);
+            String_free(name);
+            r.ok = false;
+            break;
+        }
+        frame->name = vm->func_names[a];
+        String_free(name);
+        int nslots = frame->nargs + frame->nlocals;
+        for (int j = 0; j < nslots && j < MAX_LOCALS; j++) {
+            frame->locals[j] = read_element(&r, objects, num_objects);
+        }
+    }
+    vm->callsp = callsp;
+    String *output = read_string(&r);
+    if (output != NULL && output->length < MAX_OUTPUT - 2) strcpy(vm->output, output->str);
+    else r.ok = false;
+    String_free(output);
+    if (r.ok && read32(&r)) {
+        vm->inlined_from = calloc((size_t)code_size + 1, sizeof(char *));
+        for (int i = 0; r.ok && i < code_size; i++) {
+            int a = read32(&r);
+            if (a >= 0 && a <= vm->max_func_addr) vm->inlined_from[i] = vm->func_names[a];
+        }
+    }
+    vm->ip = ip;
+
+    munmap(image, (size_t)st.st_size);
+    if (!r.ok || vm->ip > (addr32)code_size) {
+        fprintf(stderr, "truncated or corrupt snapshot %s\n", path);
+        free(objects);
+        vm_free(vm); // objects came from vm->heap
+        return NULL;
+    }
+    free(objects); // the Strings and Arrays themselves now belong to the stack/frames
+    return vm;
+}
+
+/* Load a snapshot written by vm_checkpoint; continue it with vm_resume */
+VM *vm_restore(const char *path) {
+    return restore(path, NULL, true);
+}
+
+/* Load a snapshot only if it was written with tag; NULL, quietly, if it's
+ * missing or has another tag
+ */
+VM *vm_restore_tagged(const char *path, uint64_t tag) {
+    return restore(path, &tag, false);
+}
@@ -22,8 +22,11 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "vm.h"
 #include "loader.h"
+#include "natives.h"
 
 static void inline vm_write32(byte *data, int n)   { *((int32_t *)data) = (int32_t)n; }
 static void inline vm_write16(byte *data, int n) { *((int16_t *)data) = (int16_t)n; }
@@ -42,11 +45,99 @@ Create a VM from a bytecode object/asm file, .bytecode; files look like:
 	ICONST 0
 	OR
     CALL 20,0   ; CALL addr32, nargs16
+    CALLNATIVE sfind   ; looked up in vm_natives
     ...
  */
-VM *vm_load(FILE *f)
+static VM_INSTRUCTION *mnemonics[MNEMONIC_TABLE_SIZE]; // open addressing on the name's hash
+
+static unsigned int mnemonic_hash(const char *name, size_t len)
 {
-    VM *vm = vm_alloc();
+    unsigned int h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++) h = (h ^ (byte)name[i]) * 16777619u;
+    return h & (MNEMONIC_TABLE_SIZE - 1);
+}
+
+static pthread_once_t mnemonics_once = PTHREAD_ONCE_INIT;
+
+/* Hash the opcode names; run once, by the first lookup on any thread */
+static void vm_mnemonics_init()
+{
+    for (int i = 0; i < NUM_INSTRS; i++) {
+        unsigned int h = mnemonic_hash(vm_instructions[i].name, strlen(vm_instructions[i].name));
+        while ( mnemonics[h]!=NULL ) h = (h + 1) & (MNEMONIC_TABLE_SIZE - 1);
+        mnemonics[h] = &vm_instructions[i];
+    }
+}
+
+/* The instruction named by the len chars at name, or NULL */
+VM_INSTRUCTION *vm_mnemonic(const char *name, size_t len)
+{
+    pthread_once(&mnemonics_once, vm_mnemonics_init);
+    for (unsigned int h = mnemonic_hash(name, len); mnemonics[h]!=NULL; h = (h + 1) & (MNEMONIC_TABLE_SIZE - 1)) {
+        if ( strncmp(mnemonics[h]->name, name, len)==0 && mnemonics[h]->name[len]=='\0' ) return mnemonics[h];
+    }
+    return NULL;
+}
+
+/* Encode one instruction line at code[ip]; returns the ip after it */
+static addr32 vm_decode(VM *vm, byte *code, addr32 ip, char *instr)
+{
+    char name[80];
+    int opnd1, opnd2;
+    int n = sscanf(instr, "%s %d, %d", name, &opnd1, &opnd2);
+    VM_INSTRUCTION *I = vm_instr(name);
+	if ( I==NULL ) {
+		fprintf(stderr, "unknown bytecode %s; ignoring\n", name);
+		return ip;
+	}
+    if ( I->opcode==CALLNATIVE ) { // operand is a name, not a number
+        char native[80];
+        int index = sscanf(instr, "%s %79s", name, native)==2 ? vm_native_index(native) : -1;
+        if ( index<0 ) {
+            fprintf(stderr, "unknown native function in %s", instr);
+            return ip;
+        }
+        code[ip] = I->opcode;
+        vm_write16(&code[ip+1], index);
+        return ip + 3;
+    }
+    code[ip] = I->opcode;
+    ip++;
+	int num_required_opnds = 0;
+	if ( I->opnd_sizes[0]>0 ) num_required_opnds++;
+	if ( I->opnd_sizes[1]>0 ) num_required_opnds++;
+	if ( n-1 != num_required_opnds ) {
+		char *output = print(vm->output, "operand mismatch; expecting %d, found %d\n", num_required_opnds, n-1);
+		fprintf(stderr, "%s", output);
+		return ip;
+	}
+	// deal with operands
+    if ( n>=2 ) { // got an instruction and 1 operand
+        if ( I->opnd_sizes[0]==2 ) {
+            vm_write16(&code[ip], opnd1);
+        }
+        else { // must be 4 bytes
+            vm_write32(&code[ip], opnd1);
+        }
+        ip += I->opnd_sizes[0];
+    }
+    if ( n==3 ) { // got an instruction with 2 operands; fill in 2nd operand
+		if ( I->opnd_sizes[1]==2 ) {
+			vm_write16(&code[ip], opnd2);
+		}
+		else { // must be 4 bytes
+			vm_write32(&code[ip], opnd2);
+		}
+		ip += I->opnd_sizes[1];
+    }
+    return ip;
+}
+
+/* Read the string pool and function table; leaves f at the instructions */
+static int vm_load_header(VM *vm, FILE *f, int *ninstr)
+{
+    allocator_use(vm->heap);
+    vm_natives_init();
 
     fscanf(f, "%d strings\n", &vm->num_strings);
 	if ( vm->num_strings>0 ) {
@@ -74,70 +165,187 @@ VM *vm_load(FILE *f)
 		}
 	}
 
-    int ninstr, nbytes;
-    fscanf(f, "%d instr, %d bytes\n", &ninstr, &nbytes);
+    int nbytes;
+    fscanf(f, "%d instr, %d bytes\n", ninstr, &nbytes);
+    return nbytes;
+}
+
+VM *vm_load(FILE *f)
+{
+    VM *vm = vm_alloc();
+    if ( vm==NULL ) return NULL;
+    int ninstr;
+    int nbytes = vm_load_header(vm, f, &ninstr);
     byte *code = calloc((size_t)nbytes, sizeof(byte));
     addr32 ip = 0;
     for (int i=1; i<=ninstr; i++) {
         char instr[80+1];
         fgets(instr, 80+1, f);
-        char name[80];
-        int opnd1, opnd2;
-        int n = sscanf(instr, "%s %d, %d", name, &opnd1, &opnd2);
-        VM_INSTRUCTION *I = vm_instr(name);
-		if ( I==NULL ) {
-			fprintf(stderr, "unknown bytecode %s; ignoring\n", name);
-			continue;
-		}
-        code[ip] = I->opcode;
-        ip++;
-		int num_required_opnds = 0;
-		if ( I->opnd_sizes[0]>0 ) num_required_opnds++;
-		if ( I->opnd_sizes[1]>0 ) num_required_opnds++;
-		if ( n-1 != num_required_opnds ) {
-			char *output = print(vm->output, "operand mismatch; expecting %d, found %d\n", num_required_opnds, n-1);
-			fprintf(stderr, "%s", output);
-			continue;
-		}
-		// deal with operands
-        if ( n>=2 ) { // got an instruction and 1 operand
-            if ( I->opnd_sizes[0]==2 ) {
-                vm_write16(&code[ip], opnd1);
-            }
-            else { // must be 4 bytes
-                vm_write32(&code[ip], opnd1);
-            }
-            ip += I->opnd_sizes[0];
-        }
-        if ( n==3 ) { // got an instruction with 2 operands; fill in 2nd operand
-			if ( I->opnd_sizes[1]==2 ) {
-				vm_write16(&code[ip], opnd2);
-			}
-			else { // must be 4 bytes
-				vm_write32(&code[ip], opnd2);
-			}
-			ip += I->opnd_sizes[1];
-        }
+        ip = vm_decode(vm, code, ip, instr);
     }
     vm_init(vm, code, nbytes);
     return vm;
 }
 
-VM_INSTRUCTION *vm_instr(char *name) {
-    for (int i = 0; i < NUM_INSTRS; ++i) {
-        if ( strcmp(name, vm_instructions[i].name)==0 ) {
-            return &vm_instructions[i];
-        }
+/*
+Lazy loading maps the file and reads only the string pool and function
+table up front. Code starts out all zeros (HALT) and a function is
+decoded when vm_function resolves it or a CALL first reaches it.
+
+The file has no per-function offsets, so finding a function means sizing
+instruction lines from where the last search stopped; sizing only looks
+at the mnemonic. Decoding a function also moves that frontier along, so
+a run that calls functions in file order reads each line once.
+ */
+typedef struct lazy {
+	char *map;			// the whole .bytecode file
+	size_t map_size;
+	int nfuncs;
+	addr32 *func_addr;	// function start addrs, ascending
+	size_t *func_off;	// file offset of each function's first instr line
+	bool *decoded;
+	int nfound;			// func_off is known for func_addr[0..nfound-1]
+	size_t scan_off;	// every line before this offset has been sized
+	addr32 scan_addr;	// code addr of the line at scan_off
+} Lazy;
+
+VM *vm_load_lazy(FILE *f)
+{
+    struct stat st;
+    if ( fstat(fileno(f), &st)!=0 ) return NULL;
+    VM *vm = vm_alloc();
+    if ( vm==NULL ) return NULL;
+    int ninstr;
+    int nbytes = vm_load_header(vm, f, &ninstr);
+    Lazy *lazy = calloc(1, sizeof(Lazy));
+    lazy->map_size = (size_t)st.st_size;
+    lazy->map = mmap(NULL, lazy->map_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if ( lazy->map==MAP_FAILED ) {
+        free(lazy);
+        vm_free(vm);
+        return NULL;
     }
-    return NULL;
+    lazy->scan_off = (size_t)ftell(f);
+    lazy->func_addr = calloc((size_t)vm->num_functions + 1, sizeof(addr32));
+    lazy->func_off = calloc((size_t)vm->num_functions + 1, sizeof(size_t));
+    lazy->decoded = calloc((size_t)vm->num_functions + 1, sizeof(bool));
+    for (int a = 0; a <= vm->max_func_addr && vm->num_functions>0; a++) {
+        if ( vm->func_names[a]!=NULL ) lazy->func_addr[lazy->nfuncs++] = (addr32)a;
+    }
+    vm_init(vm, calloc((size_t)nbytes, sizeof(byte)), nbytes);
+    vm->lazy = lazy;
+    return vm;
+}
+
+/* Copy the line at off into buf as fgets would; returns the offset after it */
+static size_t next_line(Lazy *lazy, size_t off, char *buf, size_t size)
+{
+    const char *p = &lazy->map[off];
+    const char *nl = memchr(p, '\n', lazy->map_size - off);
+    size_t len = nl!=NULL ? (size_t)(nl - p) + 1 : lazy->map_size - off;
+    size_t n = len<size-1 ? len : size-1;
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    return off + len;
+}
+
+/* Bytes the instruction on the line at p will take, from its mnemonic alone */
+static addr32 line_size(const char *p, const char *end)
+{
+    while ( p<end && (*p==' ' || *p=='\t') ) p++;
+    const char *q = p;
+    while ( q<end && *q>' ' ) q++;
+    VM_INSTRUCTION *I = vm_mnemonic(p, (size_t)(q - p));
+    return I!=NULL ? (addr32)vm_instr_size(I->opcode) : 0;
+}
+
+/* Move the frontier past newly reached function starts */
+static void note_functions(Lazy *lazy)
+{
+    while ( lazy->nfound<lazy->nfuncs && lazy->func_addr[lazy->nfound]<=lazy->scan_addr ) {
+        lazy->func_off[lazy->nfound++] = lazy->scan_off;
+    }
+}
+
+static int func_index(Lazy *lazy, addr32 addr)
+{
+    int lo = 0, hi = lazy->nfuncs - 1;
+    while ( lo<=hi ) {
+        int mid = (lo + hi) / 2;
+        if ( lazy->func_addr[mid]==addr ) return mid;
+        if ( lazy->func_addr[mid]<addr ) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+/* Decode the function starting at addr if it hasn't been yet */
+void vm_load_function(VM *vm, addr32 addr)
+{
+    Lazy *lazy = vm->lazy;
+    if ( lazy==NULL ) return;
+    int i = func_index(lazy, addr);
+    if ( i<0 || lazy->decoded[i] ) return;
+    char instr[80+1];
+    note_functions(lazy);
+    while ( i>=lazy->nfound && lazy->scan_off<lazy->map_size ) { // size lines up to it
+        const char *p = &lazy->map[lazy->scan_off];
+        const char *end = memchr(p, '\n', lazy->map_size - lazy->scan_off);
+        if ( end==NULL ) end = &lazy->map[lazy->map_size];
+        lazy->scan_addr += line_size(p, end);
+        lazy->scan_off = (size_t)(end - lazy->map) + 1;
+        note_functions(lazy);
+    }
+    if ( i>=lazy->nfound ) return;
+
+    addr32 end = i+1<lazy->nfuncs ? lazy->func_addr[i+1] : (addr32)vm->code_size;
+    addr32 ip = lazy->func_addr[i];
+    size_t off = lazy->func_off[i];
+    while ( ip<end && off<lazy->map_size ) {
+        off = next_line(lazy, off, instr, sizeof(instr));
+        ip = vm_decode(vm, vm->code, ip, instr);
+    }
+    lazy->decoded[i] = true;
+    if ( i+1==lazy->nfound ) { // decoding i walked the frontier to i+1
+        lazy->scan_off = off;
+        lazy->scan_addr = ip;
+        note_functions(lazy);
+    }
+}
+
+/* Decode everything not decoded yet and drop the file; passes that look
+ * at all of the code call this first.
+ */
+void vm_load_rest(VM *vm)
+{
+    if ( vm->lazy==NULL ) return;
+    for (int i = 0; i < vm->lazy->nfuncs; i++) vm_load_function(vm, vm->lazy->func_addr[i]);
+    vm_lazy_free(vm);
+}
+
+void vm_lazy_free(VM *vm)
+{
+    Lazy *lazy = vm->lazy;
+    if ( lazy==NULL ) return;
+    munmap(lazy->map, lazy->map_size);
+    free(lazy->func_addr);
+    free(lazy->func_off);
+    free(lazy->decoded);
+    free(lazy);
+    vm->lazy = NULL;
+}
+
+VM_INSTRUCTION *vm_instr(char *name) {
+    return vm_mnemonic(name, strlen(name));
 }
 
 addr32 vm_function(VM *vm, char *name) {
-    for (addr32 a = 0; a <= vm->max_func_addr; ++a) {
+    for (addr32 a = 0; (int)a <= vm->max_func_addr; ++a) {
 		char *fname = vm->func_names[a];
         if ( fname!=NULL && strcmp(name, fname)==0 ) {
+            vm_load_function(vm, a); // anyone asking is about to run it
             return a;
         }
     }
-    return 0xFFFFFFFF;
+    return NO_ADDR;
 }
\ No newline at end of file
@@ -26,7 +26,14 @@ SOFTWARE.
 #include <string.h>
 #include "vm.h"
 
+static const int MNEMONIC_TABLE_SIZE = 128; // power of 2, well over NUM_INSTRS
+
 extern VM *vm_load(FILE *f);
+extern VM *vm_load_lazy(FILE *f);
+extern void vm_load_function(VM *vm, addr32 addr);
+extern void vm_load_rest(VM *vm);
+extern void vm_lazy_free(VM *vm);
 extern BYTECODE vm_opcode(char *name);
 extern VM_INSTRUCTION *vm_instr(char *name);
+extern VM_INSTRUCTION *vm_mnemonic(const char *name, size_t len);
 extern addr32 vm_function(VM *vm, char *name);
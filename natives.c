@@ -0,0 +1,173 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "vm.h"
+#include "natives.h"
+
+/*
+Host functions callable from bytecode with CALLNATIVE name. The loader
+resolves the name to an index into vm_natives[] so registration must
+happen before vm_load (and in the same order in every process that
+shares snapshots or cached images). The VM pops nargs operands, checks
+their types against the declaration, calls fn and pushes its result; no
+frame is built.
+ */
+
+Native vm_natives[MAX_NATIVES];
+int vm_num_natives = 0;
+
+static pthread_once_t builtins_once = PTHREAD_ONCE_INIT;
+
+static void register_builtins();
+
+static int native_set(char *name, native_fn fn, element_type result, int nargs, va_list args) {
+    if (nargs < 0 || nargs > MAX_NATIVE_ARGS) return -1;
+    int i = vm_native_index(name);
+    if (i < 0) {
+        if (vm_num_natives == MAX_NATIVES) return -1;
+        i = vm_num_natives++;
+    }
+    vm_natives[i].name = name;
+    vm_natives[i].fn = fn;
+    vm_natives[i].nargs = nargs;
+    vm_natives[i].result = result;
+    for (int a = 0; a < nargs; a++) {
+        vm_natives[i].arg_types[a] = (element_type)va_arg(args, int);
+    }
+    return i;
+}
+
+/* Bind fn to name; re-registering a name replaces it, builtins included.
+ * Returns its index or -1. Not locked; register before starting threads.
+ */
+int vm_native_register(char *name, native_fn fn, element_type result, int nargs, ...) {
+    vm_natives_init(); // builtins go in first so they can't replace a host's version
+    va_list args;
+    va_start(args, nargs);
+    int i = native_set(name, fn, result, nargs, args);
+    va_end(args);
+    return i;
+}
+
+int vm_native_index(char *name) {
+    for (int i = 0; i < vm_num_natives; i++) {
+        if (strcmp(name, vm_natives[i].name) == 0) return i;
+    }
+    return -1;
+}
+
+static element int_element(int i) {
+    element el = {.type = INT, .i = i};
+    return el;
+}
+
+static element string_element(String *s) {
+    element el = {.type = STRING, .s = s};
+    return el;
+}
+
+/* atoi(s): leading int in s, 0 if none */
+static element native_atoi(VM *vm, element *args) {
+    (void)vm;
+    return int_element((int)strtol(args[0].s->str, NULL, 10));
+}
+
+/* sfind(s, t): 1-based index of t in s like SINDEX, 0 if not there */
+static element native_sfind(VM *vm, element *args) {
+    (void)vm;
+    char *p = strstr(args[0].s->str, args[1].s->str);
+    return int_element(p != NULL ? (int)(p - args[0].s->str) + 1 : 0);
+}
+
+/* ssub(s, i, n): n chars of s from 1-based index i, clipped to s */
+static element native_ssub(VM *vm, element *args) {
+    (void)vm;
+    String *s = args[0].s;
+    int i = args[1].i - 1, n = args[2].i;
+    if (i < 0) i = 0;
+    if (i > (int)s->length) i = (int)s->length;
+    if (n < 0) n = 0;
+    if (n > (int)s->length - i) n = (int)s->length - i;
+    String *t = String_alloc((size_t)n);
+    memcpy(t->str, &s->str[i], (size_t)n);
+    return string_element(t);
+}
+
+/* shash(s): 32-bit FNV-1a of s */
+static element native_shash(VM *vm, element *args) {
+    (void)vm;
+    unsigned int h = 2166136261u;
+    for (char *p = args[0].s->str; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return int_element((int)h);
+}
+
+static element native_imin(VM *vm, element *args) {
+    (void)vm;
+    return int_element(args[0].i < args[1].i ? args[0].i : args[1].i);
+}
+
+static element native_imax(VM *vm, element *args) {
+    (void)vm;
+    return int_element(args[0].i > args[1].i ? args[0].i : args[1].i);
+}
+
+static element native_iabs(VM *vm, element *args) {
+    (void)vm;
+    return int_element(args[0].i < 0 ? -args[0].i : args[0].i);
+}
+
+/* imod(x, y): x % y; there's no opcode for it */
+static element native_imod(VM *vm, element *args) {
+    (void)vm;
+    return int_element(args[1].i != 0 ? args[0].i % args[1].i : 0);
+}
+
+static void builtin(char *name, native_fn fn, element_type result, int nargs, ...) {
+    va_list args;
+    va_start(args, nargs);
+    native_set(name, fn, result, nargs, args);
+    va_end(args);
+}
+
+static void register_builtins() {
+    builtin("atoi", native_atoi, INT, 1, STRING);
+    builtin("sfind", native_sfind, INT, 2, STRING, STRING);
+    builtin("ssub", native_ssub, STRING, 3, STRING, INT, INT);
+    builtin("shash", native_shash, INT, 1, STRING);
+    builtin("imin", native_imin, INT, 2, INT, INT);
+    builtin("imax", native_imax, INT, 2, INT, INT);
+    builtin("iabs", native_iabs, INT, 1, INT);
+    builtin("imod", native_imod, INT, 2, INT, INT);
+}
+
+/* Register the standard builtins once; vm_load and vm_native_register call this */
+void vm_natives_init() {
+    pthread_once(&builtins_once, register_builtins);
+}
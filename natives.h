@@ -0,0 +1,50 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "vm.h"
+
+#ifndef NATIVES_H_
+#define NATIVES_H_
+
+static const int MAX_NATIVES = 256;
+static const int MAX_NATIVE_ARGS = 4;
+
+// args[0..nargs-1] are the operands in push order, already off the stack
+typedef element (*native_fn)(VM *vm, element *args);
+
+typedef struct {
+	char *name;
+	native_fn fn;
+	int nargs;
+	element_type arg_types[MAX_NATIVE_ARGS];
+	element_type result;	// INVALID if it pushes nothing
+} Native;
+
+extern Native vm_natives[];
+extern int vm_num_natives;
+
+extern int vm_native_register(char *name, native_fn fn, element_type result, int nargs, ...);
+extern int vm_native_index(char *name);
+extern void vm_natives_init();
+
+#endif
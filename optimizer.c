@@ -0,0 +1,541 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "vm.h"
+#include "loader.h"
+#include "optimizer.h"
+
+/*
+Bytecode-to-bytecode passes run after vm_load and before vm_exec.
+
+The inliner replaces CALL sites of small leaf functions with a copy of
+the callee's body. Args are popped into spare locals of the caller with
+STOREs, the callee's LOAD/STORE/SFREE/AFREE slots are shifted up past the
+caller's own slots, and RET becomes a BR to the end of the copy (or
+disappears if it's the last instr). RET leaves the return value on the
+operand stack anyway so no other rewriting is needed. Every copied instr
+remembers which function it came from in vm->inlined_from so traces still
+say where the code originated.
+
+The layout pass (vm_layout) uses a profile of a previous run to reorder
+basic blocks within each function; see below.
+ */
+
+typedef struct {
+    char *name;
+    addr32 start;       // address of first instr
+    addr32 end;         // one past last instr
+    int ninstrs;
+    int nargs;          // taken from CALL sites; 0 if never called
+    int nslots;         // args + locals, at least as many as LOAD/STORE touch
+    int locals_ip;      // address of the LOCALS instr or -1
+    bool leaf;          // no CALL or HALT
+    bool ends_in_ret;
+    bool branches_local;// all BR/BRF targets stay within [start,end)
+} Function;
+
+typedef struct {
+    addr32 at;          // where the 32-bit target operand lives in new code
+    addr32 target;      // old address
+} Fixup;
+
+typedef struct {
+    byte *data;
+    char **origin;      // per new address: function an inlined instr came from
+    int size;
+    int capacity;
+    Fixup *fixups;
+    int num_fixups;
+    int max_fixups;
+} Code_Buffer;
+
+static inline int32_t opt_int32(const byte *data, addr32 ip) { return *((int32_t *) &data[ip]); }
+static inline int16_t opt_int16(const byte *data, addr32 ip) { return *((int16_t *) &data[ip]); }
+static inline void opt_write32(byte *data, int n) { *((int32_t *)data) = (int32_t)n; }
+static inline void opt_write16(byte *data, int n) { *((int16_t *)data) = (int16_t)n; }
+
+static Function *find_function(Function *funcs, int n, addr32 start) {
+    int lo = 0, hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (funcs[mid].start == start) return &funcs[mid];
+        if (funcs[mid].start < start) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
+/* Collect functions in address order and summarize what the passes need */
+static int vm_scan_functions(VM *vm, Function **result) {
+    vm_load_rest(vm); // passes need every function decoded
+    Function *funcs = calloc((size_t)vm->num_functions + 1, sizeof(Function));
+    int n = 0;
+    for (addr32 a = 0; vm->func_names != NULL && (int)a <= vm->max_func_addr; a++) {
+        if (vm->func_names[a] != NULL) {
+            funcs[n].name = vm->func_names[a];
+            funcs[n].start = a;
+            n++;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        Function *f = &funcs[i];
+        f->end = i + 1 < n ? funcs[i + 1].start : (addr32)vm->code_size;
+        f->locals_ip = -1;
+        f->leaf = true;
+        f->branches_local = true;
+        int nlocals = 0, max_slot = -1;
+        byte last = HALT;
+        for (addr32 ip = f->start; ip < f->end; ip += vm_instr_size(vm->code[ip])) {
+            byte op = vm->code[ip];
+            f->ninstrs++;
+            last = op;
+            switch (op) {
+                case LOCALS:
+                    if (f->locals_ip < 0) {
+                        f->locals_ip = ip;
+                        nlocals = opt_int16(vm->code, ip + 1);
+                    }
+                    break;
+                case LOAD:
+                case STORE:
+                case SFREE:
+                case AFREE:
+                    if (opt_int16(vm->code, ip + 1) > max_slot) max_slot = opt_int16(vm->code, ip + 1);
+                    break;
+                case BR:
+                case BRF:
+                    if ((addr32)opt_int32(vm->code, ip + 1) < f->start || (addr32)opt_int32(vm->code, ip + 1) >= f->end) {
+                        f->branches_local = false;
+                    }
+                    break;
+                case CALL:
+                case HALT:
+                    f->leaf = false;
+                    break;
+                default:
+                    break;
+            }
+        }
+        f->ends_in_ret = last == RET;
+        f->nslots = max_slot + 1 > nlocals ? max_slot + 1 : nlocals;
+    }
+    // arg counts only show up at the call sites
+    for (addr32 ip = 0; ip < (addr32)vm->code_size; ip += vm_instr_size(vm->code[ip])) {
+        if (vm->code[ip] == CALL) {
+            Function *f = find_function(funcs, n, (addr32)opt_int32(vm->code, ip + 1));
+            if (f != NULL && opt_int16(vm->code, ip + 5) > f->nargs) f->nargs = opt_int16(vm->code, ip + 5);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        int nlocals = funcs[i].locals_ip >= 0 ? opt_int16(vm->code, funcs[i].locals_ip + 1) : 0;
+        if (funcs[i].nargs + nlocals > funcs[i].nslots) funcs[i].nslots = funcs[i].nargs + nlocals;
+    }
+    *result = funcs;
+    return n;
+}
+
+static bool inlinable(Function *f, int max_instrs) {
+    return f->leaf && f->ends_in_ret && f->branches_local &&
+           f->ninstrs <= max_instrs && strcmp(f->name, "main") != 0;
+}
+
+static void emit(Code_Buffer *out, const byte *instr, int size, char *origin) {
+    if (out->size + size > out->capacity) {
+        out->capacity = (out->capacity + size) * 2;
+        out->data = realloc(out->data, (size_t)out->capacity);
+        out->origin = realloc(out->origin, out->capacity * sizeof(char *));
+    }
+    memcpy(&out->data[out->size], instr, (size_t)size);
+    for (int i = 0; i < size; i++) out->origin[out->size + i] = NULL;
+    out->origin[out->size] = origin;
+    out->size += size;
+}
+
+static void emit_branch(Code_Buffer *out, byte opcode, addr32 target, char *origin) {
+    byte instr[5] = {opcode};
+    emit(out, instr, 5, origin);
+    if (out->num_fixups == out->max_fixups) {
+        out->max_fixups = out->max_fixups * 2 + 16;
+        out->fixups = realloc(out->fixups, out->max_fixups * sizeof(Fixup));
+    }
+    out->fixups[out->num_fixups].at = (addr32)out->size - 4;
+    out->fixups[out->num_fixups].target = target;
+    out->num_fixups++;
+}
+
+static void emit_slot(Code_Buffer *out, byte opcode, int slot, char *origin) {
+    byte instr[3] = {opcode};
+    opt_write16(&instr[1], slot);
+    emit(out, instr, 3, origin);
+}
+
+/* Copy callee's body in place of a CALL with its slots shifted up by base */
+static void emit_inlined(Code_Buffer *out, VM *vm, Function *callee, int base) {
+    int i;
+    for (i = callee->nargs - 1; i >= 0; i--) {
+        emit_slot(out, STORE, base + i, callee->name);
+    }
+    int fixups_before = out->num_fixups;
+    addr32 *local_map = calloc(callee->end - callee->start + 1, sizeof(addr32));
+    for (addr32 ip = callee->start; ip < callee->end; ip += vm_instr_size(vm->code[ip])) {
+        byte op = vm->code[ip];
+        local_map[ip - callee->start] = (addr32)out->size;
+        switch (op) {
+            case LOCALS:
+                break; // frame size now belongs to the caller
+            case RET:
+                if (ip + 1 < callee->end) emit_branch(out, BR, callee->end, callee->name);
+                break;
+            case LOAD:
+            case STORE:
+            case SFREE:
+            case AFREE:
+                emit_slot(out, op, base + opt_int16(vm->code, ip + 1), callee->name);
+                break;
+            case BR:
+            case BRF:
+                emit_branch(out, op, (addr32)opt_int32(vm->code, ip + 1), callee->name);
+                break;
+            default:
+                emit(out, &vm->code[ip], vm_instr_size(op), callee->name);
+                break;
+        }
+    }
+    local_map[callee->end - callee->start] = (addr32)out->size;
+    for (i = fixups_before; i < out->num_fixups; i++) {
+        Fixup *fx = &out->fixups[i];
+        opt_write32(&out->data[fx->at], local_map[fx->target - callee->start]);
+    }
+    out->num_fixups = fixups_before;
+    free(local_map);
+}
+
+/* Patch branch targets through map and swap the rewritten code into vm */
+static void install(VM *vm, Code_Buffer *out, addr32 *map, Function *funcs, int nfuncs) {
+    for (int i = 0; i < out->num_fixups; i++) {
+        opt_write32(&out->data[out->fixups[i].at], map[out->fixups[i].target]);
+    }
+    int max_func_addr = nfuncs > 0 ? (int)map[funcs[nfuncs - 1].start] : 0;
+    char **func_names = calloc((size_t)max_func_addr + 1, sizeof(char *));
+    for (int i = 0; i < nfuncs; i++) {
+        func_names[map[funcs[i].start]] = funcs[i].name;
+    }
+    free(vm->func_names);
+    free(vm->code);
+    free(vm->inlined_from);
+    free(vm->exec_counts); // counts are for the old addresses
+    free(vm->taken_counts);
+    vm->exec_counts = vm->taken_counts = NULL;
+    vm->func_names = func_names;
+    vm->max_func_addr = max_func_addr;
+    vm->code = out->data;
+    vm->code_size = out->size;
+    vm->inlined_from = out->origin;
+}
+
+/*
+Inline every CALL to a leaf function of at most max_instrs instructions
+as long as the caller's frame can hold the callee's slots in MAX_LOCALS.
+The caller needs a LOCALS to grow so its frame covers those slots.
+Returns the number of call sites inlined. Must run before vm_exec.
+ */
+int vm_inline(VM *vm, int max_instrs) {
+    Function *funcs;
+    int nfuncs = vm_scan_functions(vm, &funcs);
+    if (nfuncs == 0 || funcs[0].start != 0) { // code outside any function; leave it be
+        free(funcs);
+        return 0;
+    }
+    Code_Buffer out = {0};
+    addr32 *map = calloc((size_t)vm->code_size + 1, sizeof(addr32));
+    int count = 0;
+
+    for (int i = 0; i < nfuncs; i++) {
+        Function *f = &funcs[i];
+        int base = f->nslots, nslots = f->nslots;
+        for (addr32 ip = f->start; ip < f->end; ip += vm_instr_size(vm->code[ip])) {
+            byte op = vm->code[ip];
+            char *origin = vm->inlined_from != NULL ? vm->inlined_from[ip] : NULL;
+            map[ip] = (addr32)out.size;
+            if (op == CALL) {
+                Function *callee = find_function(funcs, nfuncs, (addr32)opt_int32(vm->code, ip + 1));
+                if (callee != NULL && callee != f && f->locals_ip >= 0 && inlinable(callee, max_instrs) &&
+                    opt_int16(vm->code, ip + 5) == callee->nargs &&
+                    base + callee->nslots <= MAX_LOCALS) {
+                    emit_inlined(&out, vm, callee, base);
+                    if (base + callee->nslots > nslots) nslots = base + callee->nslots;
+                    count++;
+                    continue;
+                }
+            }
+            if (op == BR || op == BRF || op == CALL) {
+                emit_branch(&out, op, (addr32)opt_int32(vm->code, ip + 1), origin);
+                if (op == CALL) { // keep nargs operand
+                    byte nargs[2];
+                    opt_write16(nargs, opt_int16(vm->code, ip + 5));
+                    emit(&out, nargs, 2, NULL);
+                }
+            }
+            else {
+                emit(&out, &vm->code[ip], vm_instr_size(op), origin);
+            }
+        }
+        // grow the caller's frame so traces show the slots the inlined code uses
+        if (nslots > f->nslots) {
+            opt_write16(&out.data[map[f->locals_ip] + 1], nslots - f->nargs);
+        }
+    }
+    map[vm->code_size] = (addr32)out.size;
+
+    if (count > 0) install(vm, &out, map, funcs, nfuncs);
+    else {
+        free(out.data);
+        free(out.origin);
+    }
+    free(out.fixups);
+    free(map);
+    free(funcs);
+    return count;
+}
+
+typedef struct {
+    addr32 start;
+    addr32 end;
+    addr32 last_ip;     // address of the block's last instr
+    unsigned long count;// times the block ran in the profile
+    int fall;           // block control falls into, or -1
+    int target;         // block a BR/BRF jumps to, or -1
+    bool placed;
+} Block;
+
+static unsigned int code_hash(VM *vm) {
+    unsigned int h = 2166136261u; // FNV-1a
+    vm_load_rest(vm);
+    for (int i = 0; i < vm->code_size; i++) {
+        h = (h ^ vm->code[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Count block entries by a branch, CALL or vm_start and BRF taken
+ * branches from now on. Only those instrs pay for profiling; a block
+ * entered by falling off a plain instr gets its count in find_blocks.
+ */
+void vm_profile_start(VM *vm) {
+    free(vm->exec_counts);
+    free(vm->taken_counts);
+    vm->exec_counts = calloc((size_t)vm->code_size + 1, sizeof(unsigned long));
+    vm->taken_counts = calloc((size_t)vm->code_size + 1, sizeof(unsigned long));
+}
+
+/*
+Profiles are text, one line per branch or call target that was reached
+and per BRF that branched; taken is only non-zero for BRF. The header ties a profile to the exact code it was taken from:
+
+profile 112 bytes hash=9f3a21c4
+    0: 1 0
+   20: 6 1
+ */
+bool vm_profile_write(VM *vm, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL || vm->exec_counts == NULL) {
+        fprintf(stderr, "can't write profile %s\n", path);
+        if (f != NULL) fclose(f);
+        return false;
+    }
+    fprintf(f, "profile %d bytes hash=%08x\n", vm->code_size, code_hash(vm));
+    for (int a = 0; a < vm->code_size; a++) {
+        if (vm->exec_counts[a] > 0 || vm->taken_counts[a] > 0) fprintf(f, "%5d: %lu %lu\n", a, vm->exec_counts[a], vm->taken_counts[a]);
+    }
+    return fclose(f) == 0;
+}
+
+bool vm_profile_read(VM *vm, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "can't open profile %s\n", path);
+        return false;
+    }
+    int size;
+    unsigned int hash;
+    if (fscanf(f, "profile %d bytes hash=%x\n", &size, &hash) != 2 ||
+        size != vm->code_size || hash != code_hash(vm)) {
+        fprintf(stderr, "profile %s is for different code\n", path);
+        fclose(f);
+        return false;
+    }
+    vm_profile_start(vm);
+    int a;
+    unsigned long count, taken;
+    while (fscanf(f, "%d: %lu %lu\n", &a, &count, &taken) == 3) {
+        if (a >= 0 && a < vm->code_size) {
+            vm->exec_counts[a] = count;
+            vm->taken_counts[a] = taken;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static bool ends_block(byte op) {
+    return op == BR || op == BRF || op == RET || op == HALT;
+}
+
+/* Split f into basic blocks; block_at maps an addr in f to its block or -1 */
+static int find_blocks(VM *vm, Function *f, Block **result, int *block_at) {
+    addr32 ip;
+    int n = 0;
+    bool *leader = calloc(f->end - f->start + 1, sizeof(bool));
+    leader[0] = true;
+    for (ip = f->start; ip < f->end; ip += vm_instr_size(vm->code[ip])) {
+        byte op = vm->code[ip];
+        if ((op == BR || op == BRF) && (addr32)opt_int32(vm->code, ip + 1) >= f->start &&
+            (addr32)opt_int32(vm->code, ip + 1) < f->end) {
+            leader[opt_int32(vm->code, ip + 1) - f->start] = true;
+        }
+        if (ends_block(op)) leader[ip + vm_instr_size(op) - f->start] = true;
+    }
+    for (ip = f->start; ip < f->end; ip += vm_instr_size(vm->code[ip])) {
+        if (leader[ip - f->start]) n++;
+    }
+    Block *blocks = calloc((size_t)n, sizeof(Block));
+    int b = -1;
+    for (ip = f->start; ip < f->end; ip += vm_instr_size(vm->code[ip])) {
+        if (leader[ip - f->start]) {
+            b++;
+            blocks[b].start = ip;
+            blocks[b].count = vm->exec_counts[ip];
+        }
+        blocks[b].end = ip + vm_instr_size(vm->code[ip]);
+        blocks[b].last_ip = ip;
+        block_at[ip - f->start] = b;
+    }
+    for (b = 0; b < n; b++) {
+        byte op = vm->code[blocks[b].last_ip];
+        if (b > 0 && blocks[b - 1].fall == b && vm->code[blocks[b - 1].last_ip] != BRF) {
+            blocks[b].count += blocks[b - 1].count; // fell in from a plain instr; nothing counted that
+        }
+        blocks[b].fall = op != BR && op != RET && op != HALT && b + 1 < n ? b + 1 : -1;
+        addr32 target = (addr32)opt_int32(vm->code, blocks[b].last_ip + 1);
+        blocks[b].target = (op == BR || op == BRF) && target >= f->start && target < f->end ? block_at[target - f->start] : -1;
+    }
+    free(leader);
+    *result = blocks;
+    return n;
+}
+
+/* The block to lay out right after b: its hot successor if still unplaced */
+static int hot_successor(VM *vm, Block *blocks, int b) {
+    Block *blk = &blocks[b];
+    byte op = vm->code[blk->last_ip];
+    if (op == BRF && blk->target >= 0 && !blocks[blk->target].placed) {
+        unsigned long taken = vm->taken_counts[blk->last_ip];
+        unsigned long not_taken = blk->count > taken ? blk->count - taken : 0; // the BRF ran once per block entry
+        if (taken > not_taken || blk->fall < 0 || blocks[blk->fall].placed) return blk->target;
+    }
+    if (op == BR) return blk->target >= 0 && !blocks[blk->target].placed ? blk->target : -1;
+    return blk->fall >= 0 && !blocks[blk->fall].placed ? blk->fall : -1;
+}
+
+/* Chain hot successors together starting from the entry block; when a
+ * chain ends, start the next one at the hottest block left.
+ */
+static void order_blocks(VM *vm, Block *blocks, int n, int *order) {
+    int placed = 0, b = 0;
+    while (placed < n) {
+        if (b < 0) {
+            for (int i = 0; i < n; i++) {
+                if (!blocks[i].placed && (b < 0 || blocks[i].count > blocks[b].count)) b = i;
+            }
+        }
+        blocks[b].placed = true;
+        order[placed++] = b;
+        b = hot_successor(vm, blocks, b);
+    }
+}
+
+/*
+Reorder each function's basic blocks by the profile in vm->exec_counts and
+vm->taken_counts so hot paths are contiguous and cold blocks sink to the
+end of the function. A function's entry block stays first so CALL targets
+are still function starts. A BR whose target now comes next is dropped;
+a block whose fall-through successor moved gets a BR appended. A BRF that
+is taken more often than not has its target laid out next and reaches its
+fall-through through that BR; there's no branch-if-true to flip it to.
+ */
+void vm_layout(VM *vm) {
+    if (vm->exec_counts == NULL) return;
+    Function *funcs;
+    int nfuncs = vm_scan_functions(vm, &funcs);
+    if (nfuncs == 0 || funcs[0].start != 0) {
+        free(funcs);
+        return;
+    }
+    Code_Buffer out = {0};
+    addr32 *map = calloc((size_t)vm->code_size + 1, sizeof(addr32));
+    int *block_at = calloc((size_t)vm->code_size + 1, sizeof(int));
+
+    for (int i = 0; i < nfuncs; i++) {
+        Function *f = &funcs[i];
+        Block *blocks;
+        int n = find_blocks(vm, f, &blocks, &block_at[f->start]);
+        int *order = calloc((size_t)n + 1, sizeof(int));
+        order_blocks(vm, blocks, n, order);
+        for (int k = 0; k < n; k++) {
+            Block *blk = &blocks[order[k]];
+            int next = k + 1 < n ? order[k + 1] : -1;
+            for (addr32 ip = blk->start; ip < blk->end; ip += vm_instr_size(vm->code[ip])) {
+                byte op = vm->code[ip];
+                char *origin = vm->inlined_from != NULL ? vm->inlined_from[ip] : NULL;
+                map[ip] = (addr32)out.size;
+                if (op == BR && next >= 0 && blk->target == next) continue; // falls through now
+                if (op == BR || op == BRF || op == CALL) {
+                    emit_branch(&out, op, (addr32)opt_int32(vm->code, ip + 1), origin);
+                    if (op == CALL) {
+                        byte nargs[2];
+                        opt_write16(nargs, opt_int16(vm->code, ip + 5));
+                        emit(&out, nargs, 2, NULL);
+                    }
+                }
+                else {
+                    emit(&out, &vm->code[ip], vm_instr_size(op), origin);
+                }
+            }
+            if (blk->fall >= 0 && blk->fall != next) {
+                emit_branch(&out, BR, blocks[blk->fall].start, NULL);
+            }
+        }
+        free(order);
+        free(blocks);
+    }
+    map[vm->code_size] = (addr32)out.size;
+    install(vm, &out, map, funcs, nfuncs);
+    free(out.fixups);
+    free(block_at);
+    free(map);
+    free(funcs);
+}
+
+void vm_optimize(VM *vm) {
+    vm_inline(vm, INLINE_MAX_INSTRS);
+}
@@ -0,0 +1,231 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "vm.h"
+#include "loader.h"
+#include "perf.h"
+
+/*
+Hardware counters per bytecode function via Linux perf_event_open.
+
+All counters are in one group led by cycles so a single read() gets a
+consistent set at every CALL/RET. Counters the kernel won't give us
+(containers, VMs without a PMU, perf_event_paranoid) are left out and
+reported as n/a; if none open we still charge wall-clock time and
+bytecode instr counts per function.
+ */
+
+static const char *counter_names[] = {"cycles", "instrs", "br-miss", "L1d-miss", "LLC-miss"};
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd) {
+    return (int)syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+static int open_counter(PERF_COUNTER c, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    switch (c) {
+        case PERF_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_BRANCH_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case PERF_L1D_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        default:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES; // last level cache
+            break;
+    }
+    return perf_event_open(&attr, group_fd);
+}
+
+static uint64_t now_nanos() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+static Perf_Function *function_at(Perf *p, VM *vm, addr32 func) {
+    if (func > (addr32)vm->max_func_addr) func = 0;
+    if (p->by_addr[func] == NULL) {
+        p->by_addr[func] = calloc(1, sizeof(Perf_Function));
+        p->by_addr[func]->name = vm->func_names[func] != NULL ? vm->func_names[func] : "?";
+    }
+    return p->by_addr[func];
+}
+
+/* Charge everything since the last transition to p->current and switch to next */
+static void transition(Perf *p, VM *vm, Perf_Function *next, long executed) {
+    uint64_t values[1 + PERF_NUM_COUNTERS];
+    uint64_t t = now_nanos();
+    unsigned long instrs = vm->instr_count + executed;
+    if (p->num_open > 0 && read(p->fds[PERF_CYCLES], values, sizeof(values)) > 0) {
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+            if (p->fds[c] < 0) continue;
+            uint64_t v = values[1 + p->slot[c]];
+            if (p->current != NULL) p->current->counts[c] += v - p->last[c];
+            p->last[c] = v;
+        }
+    }
+    if (p->current != NULL) {
+        p->current->nanos += t - p->last_nanos;
+        p->current->instrs += instrs - p->last_instrs;
+    }
+    p->last_nanos = t;
+    p->last_instrs = instrs;
+    p->current = next;
+}
+
+/* Start counting, charging to main; call after vm_start */
+Perf *vm_perf_open(VM *vm) {
+    Perf *p = calloc(1, sizeof(Perf));
+    p->by_addr = calloc((size_t)vm->max_func_addr + 1, sizeof(Perf_Function *));
+    p->stack = calloc((size_t)MAX_CALL_STACK_GROWN, sizeof(Perf_Function *));
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        p->fds[c] = open_counter((PERF_COUNTER)c, c == PERF_CYCLES ? -1 : p->fds[PERF_CYCLES]);
+        if (p->fds[c] >= 0) p->slot[c] = p->num_open++;
+        else if (c == PERF_CYCLES) { // no group leader, no hardware counters at all
+            for (c = 1; c < PERF_NUM_COUNTERS; c++) p->fds[c] = -1;
+            fprintf(stderr, "perf_event_open unavailable; reporting software timing only\n");
+            break;
+        }
+    }
+    if (p->num_open > 0) {
+        ioctl(p->fds[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(p->fds[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    vm->perf = p;
+    p->was_tracing = vm->tracing;
+    vm->tracing = false; // else the counters mostly measure trace formatting
+    addr32 main = vm_function(vm, "main");
+    Perf_Function *f = function_at(p, vm, main);
+    f->calls++;
+    p->stack[vm->callsp < 0 ? 0 : vm->callsp] = f;
+    transition(p, vm, f, 0);
+    return p;
+}
+
+/* A CALL to func just pushed frame vm->callsp */
+void vm_perf_enter(VM *vm, addr32 func, long executed) {
+    Perf *p = vm->perf;
+    Perf_Function *f = function_at(p, vm, func);
+    f->calls++;
+    p->stack[vm->callsp] = f;
+    transition(p, vm, f, executed);
+}
+
+/* A RET just popped a frame; back in the function of frame vm->callsp */
+void vm_perf_leave(VM *vm, long executed) {
+    Perf *p = vm->perf;
+    transition(p, vm, vm->callsp >= 0 ? p->stack[vm->callsp] : NULL, executed);
+}
+
+static int by_time(const void *a, const void *b) {
+    const Perf_Function *x = *(Perf_Function *const *)a, *y = *(Perf_Function *const *)b;
+    return x->nanos < y->nanos ? 1 : x->nanos > y->nanos ? -1 : 0;
+}
+
+static void print_per_instr(FILE *f, Perf *p, PERF_COUNTER c, Perf_Function *fn) {
+    if (p->fds[c] < 0) fprintf(f, " %9s", "n/a");
+    else fprintf(f, " %9.3f", fn->instrs > 0 ? (double)fn->counts[c] / fn->instrs : 0.0);
+}
+
+void vm_perf_report(VM *vm, FILE *f) {
+    Perf *p = vm->perf;
+    Perf_Function *total = calloc(1, sizeof(Perf_Function));
+    Perf_Function **funcs = calloc((size_t)vm->max_func_addr + 2, sizeof(Perf_Function *));
+    int n = 0;
+    transition(p, vm, p->current, 0); // bring the running function up to date
+    total->name = "total";
+    for (int a = 0; a <= vm->max_func_addr; a++) {
+        Perf_Function *fn = p->by_addr[a];
+        if (fn == NULL) continue;
+        funcs[n++] = fn;
+        total->calls += fn->calls;
+        total->instrs += fn->instrs;
+        total->nanos += fn->nanos;
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++) total->counts[c] += fn->counts[c];
+    }
+    qsort(funcs, (size_t)n, sizeof(Perf_Function *), by_time);
+    funcs[n++] = total;
+
+    fprintf(f, "%-16s %8s %10s %10s %8s %6s", "function", "calls", "bc-instrs", "ms", "ns/bc", "IPC");
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        if (c == PERF_INSTRUCTIONS) continue;
+        char heading[32];
+        sprintf(heading, "%s/bc", counter_names[c]);
+        fprintf(f, " %9s", heading);
+    }
+    fprintf(f, "\n");
+    for (int i = 0; i < n; i++) {
+        Perf_Function *fn = funcs[i];
+        fprintf(f, "%-16s %8lu %10lu %10.3f %8.1f", fn->name, fn->calls, fn->instrs, fn->nanos / 1000000.0,
+                fn->instrs > 0 ? (double)fn->nanos / fn->instrs : 0.0);
+        if (p->fds[PERF_INSTRUCTIONS] < 0 || fn->counts[PERF_CYCLES] == 0) fprintf(f, " %6s", "n/a");
+        else fprintf(f, " %6.2f", (double)fn->counts[PERF_INSTRUCTIONS] / fn->counts[PERF_CYCLES]);
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+            if (c != PERF_INSTRUCTIONS) print_per_instr(f, p, (PERF_COUNTER)c, fn);
+        }
+        fprintf(f, "\n");
+    }
+    free(funcs);
+    free(total);
+}
+
+void vm_perf_close(VM *vm) {
+    Perf *p = vm->perf;
+    if (p == NULL) return;
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        if (p->fds[c] >= 0) close(p->fds[c]);
+    }
+    for (int a = 0; a <= vm->max_func_addr; a++) free(p->by_addr[a]);
+    free(p->by_addr);
+    free(p->stack);
+    vm->tracing = p->was_tracing;
+    free(p);
+    vm->perf = NULL;
+}
@@ -0,0 +1,69 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdint.h>
+#include "vm.h"
+
+#ifndef PERF_H_
+#define PERF_H_
+
+typedef enum {
+	PERF_CYCLES=0,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_NUM_COUNTERS
+} PERF_COUNTER;
+
+typedef struct {
+	char *name;
+	unsigned long calls;
+	unsigned long instrs;		// bytecode instrs run in this function itself
+	uint64_t nanos;
+	uint64_t counts[PERF_NUM_COUNTERS];
+} Perf_Function;
+
+/* Counters are read at every CALL and RET and the difference is charged to
+ * the function that was running, so a function's numbers exclude its callees.
+ */
+typedef struct perf {
+	int fds[PERF_NUM_COUNTERS];		// -1 if that counter couldn't be opened
+	int slot[PERF_NUM_COUNTERS];	// position of each counter in a group read
+	int num_open;
+	Perf_Function **by_addr;		// func addr -> stats
+	Perf_Function **stack;			// function of each live frame
+	Perf_Function *current;
+	uint64_t last[PERF_NUM_COUNTERS];
+	uint64_t last_nanos;
+	unsigned long last_instrs;
+	bool was_tracing;				// vm->tracing before open; put back by close
+} Perf;
+
+extern Perf *vm_perf_open(VM *vm);
+extern void vm_perf_enter(VM *vm, addr32 func, long executed);
+extern void vm_perf_leave(VM *vm, long executed);
+extern void vm_perf_report(VM *vm, FILE *f);
+extern void vm_perf_close(VM *vm);
+
+#endif
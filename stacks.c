@@ -0,0 +1,101 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <sys/mman.h>
+#include <unistd.h>
+#include "stacks.h"
+
+/*
+Layout of one mapping:
+
+    [ guard | committed ... | reserved but PROT_NONE ... | guard ]
+            ^ base
+
+A fault in the low guard is an underflow. A fault past the committed
+bytes but inside the reserve grows the stack and the instruction is
+retried; a fault in the high guard is an overflow. stack_commit and
+stack_fault only call mprotect so the SIGSEGV handler can use them.
+ */
+
+static size_t page = 0; // read once in stack_map; sysconf isn't safe in a signal handler
+
+static size_t page_round(size_t n) {
+    return (n + page - 1) & ~(page - 1);
+}
+
+bool stack_map(Guarded_Stack *s, size_t initial, size_t reserve) {
+    if (page == 0) page = (size_t)sysconf(_SC_PAGESIZE);
+    reserve = page_round(reserve);
+    void *map = mmap(NULL, reserve + 2 * STACK_GUARD_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) return false;
+    s->map = map;
+    s->base = s->map + STACK_GUARD_SIZE;
+    s->committed = 0;
+    s->reserved = reserve;
+    if (!stack_commit(s, initial)) return false;
+    s->initial = s->committed;
+    return true;
+}
+
+void stack_unmap(Guarded_Stack *s) {
+    if (s->map != NULL) munmap(s->map, s->reserved + 2 * STACK_GUARD_SIZE);
+    s->map = s->base = NULL;
+    s->committed = s->initial = s->reserved = 0;
+}
+
+/* Make at least bytes from base read/write, doubling what's committed so
+ * deep recursion faults O(log n) times. False if that's past the reserve.
+ */
+bool stack_commit(Guarded_Stack *s, size_t bytes) {
+    if (bytes <= s->committed) return true;
+    if (bytes > s->reserved) return false;
+    size_t want = s->committed * 2;
+    if (want < bytes) want = bytes;
+    want = page_round(want);
+    if (want > s->reserved) want = s->reserved;
+    if (mprotect(s->base + s->committed, want - s->committed, PROT_READ | PROT_WRITE) != 0) return false;
+    s->committed = want;
+    return true;
+}
+
+/* Give back everything a deep recursion committed past the initial bytes:
+ * fault on it again and let the kernel drop the pages.
+ */
+void stack_shrink(Guarded_Stack *s) {
+    if (s->committed <= s->initial) return;
+    char *grown = s->base + s->initial;
+    size_t n = s->committed - s->initial;
+    if (mprotect(grown, n, PROT_NONE) != 0) return;
+    madvise(grown, n, MADV_DONTNEED);
+    s->committed = s->initial;
+}
+
+/* Classify a faulting address, growing the stack if it's in the reserve */
+STACK_FAULT stack_fault(Guarded_Stack *s, void *addr) {
+    char *a = addr;
+    if (s->map == NULL || a < s->map || a >= s->base + s->reserved + STACK_GUARD_SIZE) return STACK_NOT_MINE;
+    if (a < s->base) return STACK_UNDERFLOW;
+    if (a >= s->base + s->reserved) return STACK_OVERFLOW;
+    return stack_commit(s, (size_t)(a - s->base) + 1) ? STACK_OK : STACK_OVERFLOW;
+}
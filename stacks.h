@@ -0,0 +1,52 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef STACKS_H_
+#define STACKS_H_
+
+static const int STACK_GUARD_SIZE = 64 * 1024;	// PROT_NONE bytes below the bottom and above the reserve
+
+/* A stack living in its own mapping. Only the first committed bytes are
+ * read/write; the rest of the reserve and both guards fault, so the VM
+ * needs no bounds compare on push or pop.
+ */
+typedef struct {
+	char *map;			// start of the mapping, the low guard
+	char *base;			// first usable byte
+	size_t committed;	// bytes from base that are read/write
+	size_t initial;		// what stack_map committed; stack_shrink goes back to it
+	size_t reserved;	// bytes from base it can grow to
+} Guarded_Stack;
+
+typedef enum { STACK_OK=0, STACK_UNDERFLOW, STACK_OVERFLOW, STACK_NOT_MINE } STACK_FAULT;
+
+extern bool stack_map(Guarded_Stack *s, size_t initial, size_t reserve);
+extern void stack_unmap(Guarded_Stack *s);
+extern bool stack_commit(Guarded_Stack *s, size_t bytes);
+extern void stack_shrink(Guarded_Stack *s);
+extern STACK_FAULT stack_fault(Guarded_Stack *s, void *addr);
+
+#endif
@@ -25,8 +25,15 @@ SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
 #include "vm.h"
 #include "loader.h"
+#include "perf.h"
+#include "natives.h"
 
 VM_INSTRUCTION vm_instructions[] = {
         {"HALT",   HALT,   {},     0},
@@ -74,7 +81,28 @@ VM_INSTRUCTION vm_instructions[] = {
 
         {"PRINT",  PRINT,  {},     1},
         {"SLEN",   SLEN,   {},     1},
-        {"SFREE",  SFREE,  {2},    0} // free a str in a local
+        {"SFREE",  SFREE,  {2},    0}, // free a str in a local
+        {"CALLNATIVE", CALLNATIVE, {2}, 0}, // operand is an index into vm_natives; pops its nargs
+
+        {"SSUBSTR", SSUBSTR, {},   3}, // s, i, n: n chars from 1-based i, clipped
+        {"SFIND",  SFIND,  {},     2}, // s, t: 1-based index of t in s, 0 if none
+        {"SPREFIX", SPREFIX, {},   2},
+        {"SSUFFIX", SSUFFIX, {},   2},
+        {"SREPEAT", SREPEAT, {},   2}, // s, n
+        {"SUPPER", SUPPER, {},     1},
+        {"SLOWER", SLOWER, {},     1},
+
+        {"ANEW",   ANEW,   {},     1}, // n: n zeroed int32s
+        {"ALOAD",  ALOAD,  {},     2}, // a, i: 1-based like SINDEX
+        {"ASTORE", ASTORE, {},     3}, // a, i, v
+        {"ALEN",   ALEN,   {},     1},
+        {"ASUM",   ASUM,   {},     1},
+        {"AMIN",   AMIN,   {},     1}, // 0 if empty
+        {"AMAX",   AMAX,   {},     1},
+        {"AFILL",  AFILL,  {},     2}, // a, v
+        {"ACOPY",  ACOPY,  {},     1}, // pushes a new array
+        {"ASORT",  ASORT,  {},     1}, // in place
+        {"AFREE",  AFREE,  {2},    0}  // free an array in a local
 };
 
 static void vm_print_instr(VM *vm, addr32 ip);
@@ -83,17 +111,53 @@ static void vm_print_stack(VM *vm);
 
 static char *vm_print_element(char *buffer, element el);
 
+static char *vm_print_array(char *buffer, Array *a);
+
 static inline int32_t int32(const byte *data, addr32 ip);
 
 static inline int16_t int16(const byte *data, addr32 ip);
 
 static void vm_trace_print_element(VM *vm, element el);
 
+// never inlined into vm_step so its locals can't be clobbered by the siglongjmp
+static VM_STATUS vm_run(VM *vm, long max_instrs, long max_nanos, bool trace_to_stderr) __attribute__((noinline));
+
+/* The stacks have no bounds checks; running off one faults on a guard page
+ * and the SIGSEGV handler jumps back out of vm_step with this thread's state.
+ */
+static __thread VM *running = NULL;
+static __thread sigjmp_buf *fault_exit;
+static __thread STACK_FAULT fault_kind;
+static __thread const char *fault_stack;
+static __thread volatile long fault_count; // vm_run's executed as of its last budget check
+static struct sigaction prev_segv;
+static pthread_once_t guard_once = PTHREAD_ONCE_INIT;
+
 VM *vm_alloc() {
 
+    // the VM itself stays on malloc: vm->heap's reset would hand its memory back out
     VM *vm = calloc(sizeof(VM), 1);
-    vm->output = calloc(sizeof(char[MAX_OUTPUT]), 1);
-    vm->trace = calloc(sizeof(char[MAX_OUTPUT]), 1);
+    // print() only needs a '\0' to append to; don't pay to zero 2MB
+    vm->output = malloc(sizeof(char[MAX_OUTPUT]));
+    vm->trace = malloc(sizeof(char[MAX_OUTPUT]));
+    vm->output[0] = vm->output[MAX_OUTPUT - 1] = '\0';
+    vm->trace[0] = vm->trace[MAX_OUTPUT - 1] = '\0';
+    vm->tracing = true;
+    vm->heap = pool_allocator_new();
+    if (!stack_map(&vm->opnd_map, sizeof(element[MAX_OPND_STACK]), sizeof(element[MAX_OPND_STACK_GROWN])) ||
+        !stack_map(&vm->call_map, sizeof(Activation_Record[MAX_CALL_STACK]),
+                   sizeof(Activation_Record[MAX_CALL_STACK_GROWN]))) {
+        fprintf(stderr, "can't map VM stacks\n");
+        stack_unmap(&vm->opnd_map);
+        stack_unmap(&vm->call_map);
+        vm->heap->release(vm->heap);
+        free(vm->output);
+        free(vm->trace);
+        free(vm);
+        return NULL;
+    }
+    vm->stack = (element *)vm->opnd_map.base;
+    vm->call_stack = (Activation_Record *)vm->call_map.base;
     return vm;
 
 }
@@ -103,6 +167,7 @@ void vm_init(VM *vm, byte *code, int code_size) {
     vm->code_size = code_size;
     vm->sp = -1; // grow upwards, stack[sp] is top of stack and valid
     vm->callsp = -1;
+    vm->break_addr = NO_ADDR;
 }
 
 void vm_free(VM *vm) {
@@ -116,15 +181,43 @@ void vm_free(VM *vm) {
         free(vm->func_names[i]);
     }
 
-    for (i = 0; i < vm->num_strings; i++) {
-        free(vm->strings[i]);
-    }
-
     free(vm->func_names);
     free(vm->strings);
+    free(vm->inlined_from);
+    free(vm->exec_counts);
+    free(vm->taken_counts);
+    vm_perf_close(vm);
+    vm_lazy_free(vm);
+    vm->heap->release(vm->heap); // string pool and any Strings still live
+    stack_unmap(&vm->opnd_map);
+    stack_unmap(&vm->call_map);
     free(vm);
 }
 
+/* Get a VM that has run back to the state vm_init left it in, keeping its
+ * buffers, initial stacks and heap memory for the next run. Drops every String
+ * in vm->heap, so the program's constants must live in another VM's heap
+ * (e.g. one loaded program whose code and constants many VMs point at).
+ */
+void vm_reset(VM *vm) {
+    vm->ip = 0;
+    vm->sp = -1;
+    vm->callsp = -1;
+    vm->break_addr = NO_ADDR;
+    vm->status = VM_YIELDED;
+    vm->instr_count = 0;
+    vm->output[0] = vm->output[MAX_OUTPUT - 1] = '\0';
+    vm->trace[0] = vm->trace[MAX_OUTPUT - 1] = '\0';
+    memset(&vm->call_stack[0], 0, sizeof(Activation_Record)); // main's frame isn't set up by a CALL
+    free(vm->exec_counts); // a profile or counters from the last run don't carry over
+    free(vm->taken_counts);
+    vm->exec_counts = vm->taken_counts = NULL;
+    vm_perf_close(vm);
+    vm->heap->reset(vm->heap);
+    stack_shrink(&vm->opnd_map); // a runaway recursion's pages go back, not into the pool
+    stack_shrink(&vm->call_map);
+}
+
 // You don't need to use/create these functions but I used them
 // to help me when there are bugs in my code.
 static void inline validate_stack_address(VM *vm, int a) { }
@@ -132,20 +225,143 @@ static void inline validate_stack_address(VM *vm, int a) { }
 static void inline validate_stack(VM *vm, byte opcode, int sp) { }
 
 void vm_exec(VM *vm, bool trace_to_stderr) {
-    bool trace = true; // always store trace in vm->trace
+    vm_start(vm);
+    vm_resume(vm, trace_to_stderr);
+}
+
+/* Push main's frame and point ip at it, ready for vm_resume/vm_step */
+void vm_start(VM *vm) {
+    vm->call_stack[++vm->callsp].name = "main";
+    vm->ip = vm_function(vm, "main");
+    if (vm->exec_counts != NULL && vm->ip != NO_ADDR) vm->exec_counts[vm->ip]++;
+}
+
+/* Run from vm->ip until done. Returns false if it stopped because a CALL
+ * reached vm->break_addr, true when it hit HALT.
+ */
+bool vm_resume(VM *vm, bool trace_to_stderr) {
+    VM_STATUS status = vm_step(vm, 0, 0, trace_to_stderr);
+    if (status == VM_ERROR) { // the error is at the end of the output
+        puts(vm->output);
+        exit(1);
+    }
+    return status == VM_HALTED;
+}
+
+/* Commit enough of both stacks to hold stack[0..sp] and call_stack[0..callsp]
+ * without faulting, e.g. before filling them in from a snapshot.
+ */
+bool vm_stack_reserve(VM *vm, int sp, int callsp) {
+    return stack_commit(&vm->opnd_map, sizeof(element) * (size_t)(sp + 1)) &&
+           stack_commit(&vm->call_map, sizeof(Activation_Record) * (size_t)(callsp + 1));
+}
+
+/* name of the function ip is in; functions are laid out one after another */
+static char *vm_func_name_at(VM *vm, addr32 ip) {
+    if (vm->inlined_from != NULL && ip < (addr32)vm->code_size && vm->inlined_from[ip] != NULL) {
+        return vm->inlined_from[ip];
+    }
+    for (int a = (int)ip < vm->max_func_addr ? (int)ip : vm->max_func_addr; a >= 0; a--) {
+        if (vm->func_names[a] != NULL) return vm->func_names[a];
+    }
+    return "?";
+}
+
+static void stack_fault_handler(int sig, siginfo_t *info, void *context) {
+    (void)sig;
+    (void)context;
+    VM *vm = running;
+    if (vm != NULL) {
+        const char *which = "operand";
+        STACK_FAULT k = stack_fault(&vm->opnd_map, info->si_addr);
+        if (k == STACK_NOT_MINE) {
+            which = "call";
+            k = stack_fault(&vm->call_map, info->si_addr);
+        }
+        if (k == STACK_OK) return; // grown; retry the access
+        if (k != STACK_NOT_MINE) {
+            fault_kind = k;
+            fault_stack = which;
+            siglongjmp(*fault_exit, 1);
+        }
+    }
+    // a real crash; put back whoever had SIGSEGV and let it refault
+    sigaction(SIGSEGV, &prev_segv, NULL);
+}
+
+static void stack_guard_install() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = stack_fault_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER; // NODEFER: jumping out mustn't leave SIGSEGV blocked
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &prev_segv);
+}
+
+/* Run at most max_instrs instructions or max_nanos nanoseconds (0 means no
+ * limit for either) from vm->ip. The clock is only read every
+ * VM_CLOCK_CHECK_INTERVAL instrs so a time slice can overshoot a little.
+ * Everything needed to continue is in vm so just call vm_step again after
+ * VM_YIELDED; once HALTED or ERROR, vm_step keeps returning that.
+ * Overflowing or underflowing a stack is a VM_ERROR; it only counts the
+ * instrs up to the last clock check in instr_count. An error's message is
+ * appended to vm->output.
+ */
+VM_STATUS vm_step(VM *vm, long max_instrs, long max_nanos, bool trace_to_stderr) {
+    sigjmp_buf escape;
+
+    if (vm->status != VM_YIELDED) return vm->status;
+    pthread_once(&guard_once, stack_guard_install);
+    if (sigsetjmp(escape, 0) == 0) {
+        fault_exit = &escape;
+        running = vm;
+        vm_run(vm, max_instrs, max_nanos, trace_to_stderr);
+    }
+    else {
+        // ip may already be past the faulting instr's opcode
+        print(vm->output, "%s stack %s at ip=%d in %s\n", fault_stack,
+               fault_kind == STACK_UNDERFLOW ? "underflow" : "overflow", vm->ip, vm_func_name_at(vm, vm->ip));
+        vm->instr_count += fault_count;
+        vm->status = VM_ERROR;
+    }
+    running = NULL;
+    return vm->status;
+}
+
+static VM_STATUS vm_run(VM *vm, long max_instrs, long max_nanos, bool trace_to_stderr) {
+    bool trace = true; // store trace in vm->trace unless vm->tracing is off
     int x, y, g, opcode;
     size_t size;
     short n;
     bool t, f;
     String *o;
     String *k, *p;
+    Array *r;
     char z;
     char *q, *w;
     Activation_Record *m;
-    vm->call_stack[++vm->callsp].name = "main";
-    vm->ip = vm_function(vm, "main");
+    Native *nf;
+    struct timespec start, now;
+    long executed = 0;
+    long next_check = max_instrs > 0 && max_instrs < VM_CLOCK_CHECK_INTERVAL ? max_instrs : VM_CLOCK_CHECK_INTERVAL;
+
+    fault_count = 0;
+    allocator_use(vm->heap);
+    if (max_nanos > 0) clock_gettime(CLOCK_MONOTONIC, &start);
     opcode = vm->code[vm->ip];
-    while (opcode != HALT && vm->ip < vm->code_size) {
+    while (opcode != HALT && vm->ip < (addr32)vm->code_size) {
+        if (executed == next_check) { // budget used up, or time to look at the clock and publish the count
+            fault_count = executed; // all a stack fault gets; executed itself stays in a register
+            if (max_instrs > 0 && executed >= max_instrs) break;
+            if (max_nanos > 0) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                if ((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) >= max_nanos) break;
+            }
+            next_check = executed + VM_CLOCK_CHECK_INTERVAL;
+            if (max_instrs > 0 && next_check > max_instrs) next_check = max_instrs;
+        }
+        executed++;
+        trace = vm->tracing && vm->trace[MAX_OUTPUT - 1] == '\0'; // stop once print() has filled it
 
         if (trace) {
             vm_print_instr(vm, vm->ip);
@@ -190,8 +406,14 @@ void vm_exec(VM *vm, bool trace_to_stderr) {
                 vm->stack[++vm->sp].s = o;
                 break;
             case LOCALS:
-                vm->call_stack[vm->callsp].nlocals = int16(vm->code, vm->ip);
-                vm->ip += 2;;
+                m = &vm->call_stack[vm->callsp];
+                m->nlocals = int16(vm->code, vm->ip);
+                vm->ip += 2;
+                // no stale Strings/Arrays from an earlier call in the new slots
+                if (m->nargs < MAX_LOCALS) {
+                    g = m->nargs + m->nlocals < MAX_LOCALS ? m->nlocals : MAX_LOCALS - m->nargs;
+                    memset(&m->locals[m->nargs], 0, g * sizeof(element));
+                }
                 break;
             case SCONST:
                 n = int16(vm->code, vm->ip);
@@ -212,7 +434,7 @@ void vm_exec(VM *vm, bool trace_to_stderr) {
             case SFREE:
                 n = int16(vm->code, vm->ip);
                 vm->ip += 2;
-                free(vm->call_stack[vm->callsp].locals[n].s);
+                String_free(vm->call_stack[vm->callsp].locals[n].s);
                 vm->call_stack[vm->callsp].locals[n].type = NULL;
                 vm->call_stack[vm->callsp].locals[n].s = NULL;
                 break;
@@ -305,34 +527,164 @@ void vm_exec(VM *vm, bool trace_to_stderr) {
                 vm->stack[++vm->sp].s = String_from_char(z);
                 vm->stack[vm->sp].type = STRING;
                 break;
+            case SSUBSTR:
+                y = vm->stack[vm->sp--].i;
+                x = vm->stack[vm->sp--].i;
+                k = vm->stack[vm->sp--].s;
+                vm->stack[++vm->sp].s = String_substr(k, x, y);
+                vm->stack[vm->sp].type = STRING;
+                break;
+            case SFIND:
+                k = vm->stack[vm->sp--].s;
+                p = vm->stack[vm->sp--].s;
+                vm->stack[++vm->sp].i = String_find(p, k);
+                vm->stack[vm->sp].type = INT;
+                break;
+            case SPREFIX:
+                k = vm->stack[vm->sp--].s;
+                p = vm->stack[vm->sp--].s;
+                vm->stack[++vm->sp].b = String_prefix(p, k);
+                vm->stack[vm->sp].type = BOOLEAN;
+                break;
+            case SSUFFIX:
+                k = vm->stack[vm->sp--].s;
+                p = vm->stack[vm->sp--].s;
+                vm->stack[++vm->sp].b = String_suffix(p, k);
+                vm->stack[vm->sp].type = BOOLEAN;
+                break;
+            case SREPEAT:
+                x = vm->stack[vm->sp--].i;
+                k = vm->stack[vm->sp--].s;
+                vm->stack[++vm->sp].s = String_repeat(k, x);
+                vm->stack[vm->sp].type = STRING;
+                break;
+            case SUPPER:
+                k = vm->stack[vm->sp].s;
+                vm->stack[vm->sp].s = String_upper(k);
+                break;
+            case SLOWER:
+                k = vm->stack[vm->sp].s;
+                vm->stack[vm->sp].s = String_lower(k);
+                break;
+            case ANEW:
+                x = vm->stack[vm->sp--].i;
+                r = Array_new(x);
+                if (r == NULL) {
+                    print(vm->output, "can't allocate array of %d at ip=%d\n", x, (vm->ip - 1));
+                    vm->instr_count += executed;
+                    vm->status = VM_ERROR;
+                    return VM_ERROR;
+                }
+                vm->stack[++vm->sp].a = r;
+                vm->stack[vm->sp].type = ARRAY;
+                break;
+            case ALOAD:
+                x = vm->stack[vm->sp--].i;
+                r = vm->stack[vm->sp--].a;
+                if (x < 1 || (size_t)x > r->length) {
+                    print(vm->output, "array index %d out of bounds 1..%zu at ip=%d\n", x, r->length, (vm->ip - 1));
+                    vm->instr_count += executed;
+                    vm->status = VM_ERROR;
+                    return VM_ERROR;
+                }
+                vm->stack[++vm->sp].i = r->data[x - 1];
+                vm->stack[vm->sp].type = INT;
+                break;
+            case ASTORE:
+                y = vm->stack[vm->sp--].i;
+                x = vm->stack[vm->sp--].i;
+                r = vm->stack[vm->sp--].a;
+                if (x < 1 || (size_t)x > r->length) {
+                    print(vm->output, "array index %d out of bounds 1..%zu at ip=%d\n", x, r->length, (vm->ip - 1));
+                    vm->instr_count += executed;
+                    vm->status = VM_ERROR;
+                    return VM_ERROR;
+                }
+                r->data[x - 1] = y;
+                break;
+            case ALEN:
+                r = vm->stack[vm->sp].a;
+                vm->stack[vm->sp].i = (int)r->length;
+                vm->stack[vm->sp].type = INT;
+                break;
+            case ASUM:
+                r = vm->stack[vm->sp].a;
+                vm->stack[vm->sp].i = Array_sum(r);
+                vm->stack[vm->sp].type = INT;
+                break;
+            case AMIN:
+                r = vm->stack[vm->sp].a;
+                vm->stack[vm->sp].i = Array_min(r);
+                vm->stack[vm->sp].type = INT;
+                break;
+            case AMAX:
+                r = vm->stack[vm->sp].a;
+                vm->stack[vm->sp].i = Array_max(r);
+                vm->stack[vm->sp].type = INT;
+                break;
+            case AFILL:
+                x = vm->stack[vm->sp--].i;
+                Array_fill(vm->stack[vm->sp--].a, x);
+                break;
+            case ACOPY:
+                r = Array_dup(vm->stack[vm->sp].a);
+                if (r == NULL) {
+                    print(vm->output, "can't copy array of %zu at ip=%d\n", vm->stack[vm->sp].a->length, (vm->ip - 1));
+                    vm->instr_count += executed;
+                    vm->status = VM_ERROR;
+                    return VM_ERROR;
+                }
+                vm->stack[vm->sp].a = r;
+                break;
+            case ASORT:
+                Array_sort(vm->stack[vm->sp--].a);
+                break;
+            case AFREE:
+                n = int16(vm->code, vm->ip);
+                vm->ip += 2;
+                Array_free(vm->call_stack[vm->callsp].locals[n].a);
+                vm->call_stack[vm->callsp].locals[n].type = INVALID;
+                vm->call_stack[vm->callsp].locals[n].a = NULL;
+                break;
             case BR:
                 x = int32(vm->code, vm->ip);
                 vm->ip = x;
+                if (vm->exec_counts != NULL) vm->exec_counts[vm->ip]++;
                 break;
             case BRF:
                 x = int32(vm->code, vm->ip);
                 if (vm->stack[vm->sp--].b == false) {
+                    if (vm->taken_counts != NULL) vm->taken_counts[vm->ip - 1]++;
                     vm->ip = (addr32)x;
                 } else {
                     vm->ip += 4;
                 }
+                if (vm->exec_counts != NULL) vm->exec_counts[vm->ip]++;
                 break;
             case POP:
                 vm->sp--;
                 break;
             case CALL:
                 x = int32(vm->code, vm->ip);
+                if (vm->lazy != NULL) vm_load_function(vm, (addr32)x);
                 vm->ip += 4;
                 y = int16(vm->code, vm->ip);
                 vm->ip += 2;
                 m = &vm->call_stack[++vm->callsp];
                 m->nargs = y;
+                m->nlocals = 0; // until LOCALS runs; this frame may hold a previous call's
                 m->retaddr = vm->ip;
                 for (g = y - 1; g > -1; g--) {
                     m->locals[g] = vm->stack[vm->sp--];
                 }
                 m->name = vm->func_names[x];
                 vm->ip = (addr32)x;
+                if (vm->exec_counts != NULL) vm->exec_counts[vm->ip]++;
+                if (vm->perf != NULL) vm_perf_enter(vm, vm->ip, executed);
+                if (vm->ip == vm->break_addr) { // yield before the callee's first instr
+                    vm->break_addr = NO_ADDR;
+                    max_instrs = next_check = executed;
+                }
                 break;
             case OR:
                 t = vm->stack[vm->sp--].b;
@@ -353,16 +705,34 @@ void vm_exec(VM *vm, bool trace_to_stderr) {
                 break;
             case NOT:
                 t = vm->stack[vm->sp--].b;
-                vm->stack[++vm->sp].b = !x;
+                vm->stack[++vm->sp].b = !t;
                 vm->stack[vm->sp].type = BOOLEAN;
                 break;
             case RET:
                 m = &vm->call_stack[vm->callsp--];
                 vm->ip = m->retaddr;
+                if (vm->perf != NULL) vm_perf_leave(vm, executed);
+                break;
+            case CALLNATIVE:
+                nf = &vm_natives[int16(vm->code, vm->ip)];
+                vm->ip += 2;
+                for (g = 0; g < nf->nargs; g++) { // leave the args on the stack if one is wrong
+                    if (vm->stack[vm->sp - nf->nargs + 1 + g].type != nf->arg_types[g]) {
+                        print(vm->output, "native %s: arg %d has wrong type at ip=%d\n", nf->name, g + 1, (vm->ip - 3));
+                        vm->instr_count += executed;
+                        vm->status = VM_ERROR;
+                        return VM_ERROR;
+                    }
+                }
+                vm->sp -= nf->nargs;
+                vm->stack[vm->sp + 1] = nf->fn(vm, &vm->stack[vm->sp + 1]);
+                if (nf->result != INVALID) vm->sp++;
                 break;
             default:
-                printf("invalid opcode: %d at ip=%d\n", opcode, (vm->ip - 1));
-                exit(1);
+                print(vm->output, "invalid opcode: %d at ip=%d\n", opcode, (vm->ip - 1));
+                vm->instr_count += executed;
+                vm->status = VM_ERROR;
+                return VM_ERROR;
         }
         if (trace) {
             vm_print_stack(vm);
@@ -370,12 +740,21 @@ void vm_exec(VM *vm, bool trace_to_stderr) {
         }
         opcode = vm->code[vm->ip];
     }
+    vm->instr_count += executed;
+    if (opcode != HALT && vm->ip < (addr32)vm->code_size) return VM_YIELDED;
     if (trace) {
         vm_print_instr(vm, vm->ip);
         vm_print_stack(vm);
         if (trace_to_stderr) fprintf(stderr, "%s", vm->trace);
     }
+    vm->status = VM_HALTED;
+    return VM_HALTED;
+}
 
+/* size in bytes of an instr including its operands */
+int vm_instr_size(byte opcode) {
+    VM_INSTRUCTION *inst = &vm_instructions[opcode];
+    return 1 + inst->opnd_sizes[0] + inst->opnd_sizes[1];
 }
 
 /* return a 32-bit integer at data[ip] */
@@ -425,12 +804,18 @@ static void vm_print_instr(VM *vm, addr32 ip) {
     if (inst->opnd_sizes[1] > 0) {
         vm_print_instr_opnd2(vm, ip);
     }
+    else if (op_code == CALLNATIVE) {
+        print(vm->trace, "%04d:  %-15s%-10s", ip, inst->name, vm_natives[int16(vm->code, ip + 1)].name);
+    }
     else if (inst->opnd_sizes[0] > 0) {
         vm_print_instr_opnd1(vm, ip);
     }
     else {
         vm_print_instr_opnd0(vm, ip);
     }
+    if (vm->inlined_from != NULL && ip < (addr32)vm->code_size && vm->inlined_from[ip] != NULL) {
+        print(vm->trace, "<%s> ", vm->inlined_from[ip]);
+    }
 }
 
 static void vm_print_stack(VM *vm) {
@@ -473,19 +858,45 @@ char *vm_print_element(char *buffer, element el) {
             return print(buffer, "%s", el.b ? "true" : "false");
         case STRING :
             return print(buffer, "%s", el.s->str);
+        case ARRAY :
+            return vm_print_array(buffer, el.a);
         default:
             return print(buffer, "%s", "?");
     }
 }
 
+/* [1, 2, 3]; written in place since print() strlens the whole buffer per call */
+static char *vm_print_array(char *buffer, Array *a) {
+    char *start = print(buffer, "[");
+    if (buffer[MAX_OUTPUT - 1] != '\0') return start;
+    size_t n = (size_t)(start - buffer) + 1;
+    for (size_t i = 0; i < a->length; i++) {
+        if (n + 16 >= MAX_OUTPUT - 2) { // same as print() running out of room
+            buffer[n] = '\0';
+            buffer[MAX_OUTPUT - 1] = 1;
+            return start;
+        }
+        n += sprintf(&buffer[n], i == 0 ? "%d" : ", %d", a->data[i]);
+    }
+    print(buffer, "]");
+    return start;
+}
+
 char *print(char *buffer, char *fmt, ...) {
     va_list args;
     char buf[1000];
 
+    // output and trace are MAX_OUTPUT long; the last char marks one that filled up
+    if (buffer[MAX_OUTPUT - 1] != '\0') return &buffer[MAX_OUTPUT - 2];
     size_t n = strlen(buffer);
     va_start(args, fmt);
     vsnprintf(buf, sizeof(buf) - 1, fmt, args);
-    strcat(buffer, buf);
+    if (n + strlen(buf) < MAX_OUTPUT - 2) strcpy(&buffer[n], buf);
+    else {
+        buffer[MAX_OUTPUT - 2] = '\0';
+        buffer[MAX_OUTPUT - 1] = 1;
+        n = MAX_OUTPUT - 2;
+    }
     va_end(args);
     return &buffer[n];
 }
@@ -27,19 +27,27 @@ SOFTWARE.
 #include <string.h>
 
 #include "vm_strings.h"
+#include "vm_arrays.h"
+#include "allocator.h"
+#include "stacks.h"
 
 #ifndef VM_H_
 #define VM_H_
 
 static const int MAX_OUTPUT	= 1000000;	// max 100k output
 static const int MAX_LOCALS		= 10;	// max locals/args in activation record
-static const int MAX_CALL_STACK = 1000;
-static const int MAX_OPND_STACK = 1000;
+static const int MAX_CALL_STACK = 1000;	// frames committed up front
+static const int MAX_OPND_STACK = 1000;	// elements committed up front
+static const int MAX_CALL_STACK_GROWN = 1 << 20;	// deep recursion grows the stacks up to this
+static const int MAX_OPND_STACK_GROWN = 1 << 20;
+static const int VM_CLOCK_CHECK_INTERVAL = 1024; // instrs between clock reads (and fault counts) in vm_step
 
 typedef unsigned char byte;
 typedef uintptr_t word; // has to be big enough to hold a native machine pointer
 typedef unsigned int addr32;
 
+#define NO_ADDR 0xFFFFFFFF
+
 // Bytecodes are all 8 bits but operand size can vary
 // Explicitly type the operations, even the loads/stores
 // for both safety, efficiency, and possible JIT from bytecodes later.
@@ -90,9 +98,30 @@ typedef enum {
 	PRINT,
 	SLEN,
 	SFREE,
+	CALLNATIVE,
+
+	SSUBSTR,
+	SFIND,
+	SPREFIX,
+	SSUFFIX,
+	SREPEAT,
+	SUPPER,
+	SLOWER,
+
+	ANEW,
+	ALOAD,
+	ASTORE,
+	ALEN,
+	ASUM,
+	AMIN,
+	AMAX,
+	AFILL,
+	ACOPY,
+	ASORT,
+	AFREE,
 } BYTECODE;
 
-static const int NUM_INSTRS		= SFREE+1; // last opcode value + 1 is num instructions
+static const int NUM_INSTRS		= AFREE+1; // last opcode value + 1 is num instructions
 
 typedef struct {
 	char *name;
@@ -101,7 +130,7 @@ typedef struct {
 	int num_stack_opnds;
 } VM_INSTRUCTION;
 
-typedef enum { INVALID=0, INT, BOOLEAN, STRING } element_type;
+typedef enum { INVALID=0, INT, BOOLEAN, STRING, ARRAY } element_type;
 
 typedef struct {
 	element_type type;
@@ -109,6 +138,7 @@ typedef struct {
 		int i;
 		bool b;
 		String *s;
+		Array *a;
 	};
 } element;
 
@@ -120,16 +150,27 @@ typedef struct activation_record {
 	element locals[MAX_LOCALS]; 	// args + locals go here per func def
 } Activation_Record;
 
+typedef enum {
+	VM_YIELDED=0,	// budget ran out (or not started yet); vm_step again to continue
+	VM_HALTED,
+	VM_ERROR
+} VM_STATUS;
+
 typedef struct {
 	// registers
 	addr32 ip;        	// instruction pointer register
     int sp;             // stack pointer register
 	int callsp;			// call stack pointer register
+	addr32 break_addr;	// a CALL to this addr makes vm_step yield; NO_ADDR if none
+	VM_STATUS status;
+	unsigned long instr_count;	// instrs executed so far
 
 	byte *code;   		// byte-addressable code memory.
 	int code_size;
-	element stack[MAX_OPND_STACK]; 	// operand stack, grows upwards; word addressable
-	Activation_Record call_stack[MAX_CALL_STACK];
+	element *stack; 	// operand stack, grows upwards; word addressable
+	Activation_Record *call_stack;
+	Guarded_Stack opnd_map;		// where stack lives; running off either end faults
+	Guarded_Stack call_map;		// where call_stack lives
 
 	int num_functions;
 	int max_func_addr;
@@ -137,6 +178,14 @@ typedef struct {
 	int num_strings;
 	String **strings;
 
+	Allocator *heap;	// every String this VM makes comes from here
+	char **inlined_from;	// per code addr, func an inlined instr came from; NULL if not optimized
+	unsigned long *exec_counts;		// per branch/call target when profiling, else NULL
+	unsigned long *taken_counts;	// per BRF addr, times it branched
+	struct perf *perf;				// hardware counters per function when measuring, else NULL
+	struct lazy *lazy;				// file and function offsets while loading lazily, else NULL
+
+	bool tracing;		// append every instr and the stacks to trace; on from vm_alloc
 	char *trace;
 	char *output;		// prints strcat on to the end of this buffer
 } VM;
@@ -144,8 +193,14 @@ typedef struct {
 extern VM *vm_alloc();
 extern void vm_init(VM *vm, byte *code, int code_size);
 extern void vm_free(VM *vm);
+extern void vm_reset(VM *vm);
 extern void vm_exec(VM *vm, bool trace_to_stderr);
+extern void vm_start(VM *vm);
+extern bool vm_resume(VM *vm, bool trace_to_stderr);
+extern VM_STATUS vm_step(VM *vm, long max_instrs, long max_nanos, bool trace_to_stderr);
+extern bool vm_stack_reserve(VM *vm, int sp, int callsp);
 extern VM_INSTRUCTION vm_instructions[];
+extern int vm_instr_size(byte opcode);
 extern char *print(char *buffer, char *fmt, ...);
 
 #endif
@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vm_arrays.h"
+#include "allocator.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ARRAY_SIMD
+#endif
+
+Array *Array_alloc(size_t length) {
+	if ( length > ARRAY_MAX_LENGTH ) return NULL;
+	Allocator *a = allocator_current();
+	Array *p = (Array *)a->alloc(a, sizeof(Array) + length * sizeof(int32_t));
+	if ( p == NULL ) return NULL;
+	p->length = length;
+	memset(p->data, 0, length * sizeof(int32_t));
+	return p;
+}
+
+void Array_free(Array *p) {
+	if ( p == NULL ) return;
+	Allocator *a = allocator_current();
+	a->free(a, p, sizeof(Array) + p->length * sizeof(int32_t));
+}
+
+Array *Array_new(int length) {
+	return Array_alloc(length > 0 ? (size_t)length : 0);
+}
+
+Array *Array_dup(Array *orig) {
+	Array *p = Array_alloc(orig->length);
+	if ( p == NULL ) return NULL;
+	memcpy(p->data, orig->data, orig->length * sizeof(int32_t));
+	return p;
+}
+
+/*
+Sum, min, max and fill come in scalar, SSE2 and AVX2 flavors picked by
+CPUID in a constructor, the same way as the string kernels. Sums add in
+uint32 lanes so they wrap like IADD instead of overflowing. SSE2 has no
+32-bit min/max so it selects with a compare mask. Sort is an LSD radix
+sort, four byte-wide counting passes; there's no SIMD in it. Without
+memory for its scratch buffer it falls back to qsort in place.
+ */
+
+static int32_t sum_scalar(const int32_t *d, size_t n) {
+	uint32_t s = 0;
+	for (size_t i = 0; i < n; i++) s += (uint32_t)d[i];
+	return (int32_t)s;
+}
+
+/* n >= 1 for min and max */
+static int32_t min_scalar(const int32_t *d, size_t n) {
+	int32_t m = d[0];
+	for (size_t i = 1; i < n; i++) if ( d[i] < m ) m = d[i];
+	return m;
+}
+
+static int32_t max_scalar(const int32_t *d, size_t n) {
+	int32_t m = d[0];
+	for (size_t i = 1; i < n; i++) if ( d[i] > m ) m = d[i];
+	return m;
+}
+
+static void fill_scalar(int32_t *d, size_t n, int32_t v) {
+	for (size_t i = 0; i < n; i++) d[i] = v;
+}
+
+#ifdef ARRAY_SIMD
+__attribute__((target("sse2")))
+static int32_t sum_sse2(const int32_t *d, size_t n) {
+	__m128i acc = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i *)&d[i]));
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	uint32_t s = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	return (int32_t)(s + (uint32_t)sum_scalar(&d[i], n - i));
+}
+
+/* a where mask is set, b elsewhere */
+__attribute__((target("sse2")))
+static inline __m128i select_sse2(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+__attribute__((target("sse2")))
+static int32_t min_sse2(const int32_t *d, size_t n) {
+	if ( n < 4 ) return min_scalar(d, n);
+	__m128i m = _mm_loadu_si128((const __m128i *)d);
+	size_t i = 4;
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&d[i]);
+		m = select_sse2(_mm_cmpgt_epi32(m, v), v, m);
+	}
+	int32_t lanes[4];
+	_mm_storeu_si128((__m128i *)lanes, m);
+	int32_t r = min_scalar(lanes, 4);
+	if ( i < n ) {
+		int32_t t = min_scalar(&d[i], n - i);
+		if ( t < r ) r = t;
+	}
+	return r;
+}
+
+__attribute__((target("sse2")))
+static int32_t max_sse2(const int32_t *d, size_t n) {
+	if ( n < 4 ) return max_scalar(d, n);
+	__m128i m = _mm_loadu_si128((const __m128i *)d);
+	size_t i = 4;
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&d[i]);
+		m = select_sse2(_mm_cmpgt_epi32(v, m), v, m);
+	}
+	int32_t lanes[4];
+	_mm_storeu_si128((__m128i *)lanes, m);
+	int32_t r = max_scalar(lanes, 4);
+	if ( i < n ) {
+		int32_t t = max_scalar(&d[i], n - i);
+		if ( t > r ) r = t;
+	}
+	return r;
+}
+
+__attribute__((target("sse2")))
+static void fill_sse2(int32_t *d, size_t n, int32_t v) {
+	__m128i x = _mm_set1_epi32(v);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) _mm_storeu_si128((__m128i *)&d[i], x);
+	fill_scalar(&d[i], n - i, v);
+}
+
+__attribute__((target("avx2")))
+static int32_t sum_avx2(const int32_t *d, size_t n) {
+	__m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) { // two accumulators to hide the add latency
+		acc0 = _mm256_add_epi32(acc0, _mm256_loadu_si256((const __m256i *)&d[i]));
+		acc1 = _mm256_add_epi32(acc1, _mm256_loadu_si256((const __m256i *)&d[i + 8]));
+	}
+	__m256i acc = _mm256_add_epi32(acc0, acc1);
+	__m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i *)lanes, half);
+	uint32_t s = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	return (int32_t)(s + (uint32_t)sum_sse2(&d[i], n - i));
+}
+
+__attribute__((target("avx2")))
+static int32_t min_avx2(const int32_t *d, size_t n) {
+	if ( n < 8 ) return min_sse2(d, n);
+	__m256i m = _mm256_loadu_si256((const __m256i *)d);
+	size_t i = 8;
+	for (; i + 8 <= n; i += 8) m = _mm256_min_epi32(m, _mm256_loadu_si256((const __m256i *)&d[i]));
+	__m128i half = _mm_min_epi32(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+	int32_t lanes[4];
+	_mm_storeu_si128((__m128i *)lanes, half);
+	int32_t r = min_scalar(lanes, 4);
+	if ( i < n ) {
+		int32_t t = min_scalar(&d[i], n - i);
+		if ( t < r ) r = t;
+	}
+	return r;
+}
+
+__attribute__((target("avx2")))
+static int32_t max_avx2(const int32_t *d, size_t n) {
+	if ( n < 8 ) return max_sse2(d, n);
+	__m256i m = _mm256_loadu_si256((const __m256i *)d);
+	size_t i = 8;
+	for (; i + 8 <= n; i += 8) m = _mm256_max_epi32(m, _mm256_loadu_si256((const __m256i *)&d[i]));
+	__m128i half = _mm_max_epi32(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+	int32_t lanes[4];
+	_mm_storeu_si128((__m128i *)lanes, half);
+	int32_t r = max_scalar(lanes, 4);
+	if ( i < n ) {
+		int32_t t = max_scalar(&d[i], n - i);
+		if ( t > r ) r = t;
+	}
+	return r;
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(int32_t *d, size_t n, int32_t v) {
+	__m256i x = _mm256_set1_epi32(v);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) _mm256_storeu_si256((__m256i *)&d[i], x);
+	fill_sse2(&d[i], n - i, v);
+}
+#endif
+
+static int32_t (*sum_kernel)(const int32_t *d, size_t n) = sum_scalar;
+static int32_t (*min_kernel)(const int32_t *d, size_t n) = min_scalar;
+static int32_t (*max_kernel)(const int32_t *d, size_t n) = max_scalar;
+static void (*fill_kernel)(int32_t *d, size_t n, int32_t v) = fill_scalar;
+static const char *kernels = "scalar";
+
+/* before main, so no thread ever sees the pointers change */
+__attribute__((constructor))
+static void pick_kernels() {
+#ifdef ARRAY_SIMD
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") ) {
+		sum_kernel = sum_avx2;
+		min_kernel = min_avx2;
+		max_kernel = max_avx2;
+		fill_kernel = fill_avx2;
+		kernels = "avx2";
+		return;
+	}
+	if ( __builtin_cpu_supports("sse2") ) {
+		sum_kernel = sum_sse2;
+		min_kernel = min_sse2;
+		max_kernel = max_sse2;
+		fill_kernel = fill_sse2;
+		kernels = "sse2";
+		return;
+	}
+#endif
+}
+
+/* which kernels this CPU runs: "avx2", "sse2" or "scalar" */
+const char *Array_kernels() {
+	return kernels;
+}
+
+int Array_sum(Array *a) {
+	return sum_kernel(a->data, a->length);
+}
+
+int Array_min(Array *a) {
+	return a->length == 0 ? 0 : min_kernel(a->data, a->length);
+}
+
+int Array_max(Array *a) {
+	return a->length == 0 ? 0 : max_kernel(a->data, a->length);
+}
+
+void Array_fill(Array *a, int value) {
+	fill_kernel(a->data, a->length, value);
+}
+
+static int compare_int32(const void *a, const void *b) {
+	int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void insertion_sort(int32_t *d, size_t n) {
+	for (size_t i = 1; i < n; i++) {
+		int32_t v = d[i];
+		size_t j = i;
+		for (; j > 0 && d[j - 1] > v; j--) d[j] = d[j - 1];
+		d[j] = v;
+	}
+}
+
+/* ascending, in place */
+void Array_sort(Array *a) {
+	size_t n = a->length;
+	if ( n <= 32 ) {
+		insertion_sort(a->data, n);
+		return;
+	}
+	Allocator *heap = allocator_current();
+	uint32_t *scratch = (uint32_t *)heap->alloc(heap, n * sizeof(uint32_t));
+	if ( scratch == NULL ) {
+		qsort(a->data, n, sizeof(int32_t), compare_int32);
+		return;
+	}
+	uint32_t *src = (uint32_t *)a->data, *dst = scratch;
+	for (int shift = 0; shift < 32; shift += 8) {
+		size_t count[256] = {0};
+		for (size_t i = 0; i < n; i++) count[((src[i] ^ 0x80000000u) >> shift) & 0xFF]++; // flip sign so negatives sort first
+		if ( count[((src[0] ^ 0x80000000u) >> shift) & 0xFF] == n ) continue; // all share this byte
+		size_t at = 0;
+		for (int b = 0; b < 256; b++) {
+			size_t c = count[b];
+			count[b] = at;
+			at += c;
+		}
+		for (size_t i = 0; i < n; i++) dst[count[((src[i] ^ 0x80000000u) >> shift) & 0xFF]++] = src[i];
+		uint32_t *t = src;
+		src = dst;
+		dst = t;
+	}
+	if ( src != (uint32_t *)a->data ) memcpy(a->data, src, n * sizeof(uint32_t));
+	heap->free(heap, scratch, n * sizeof(uint32_t));
+}
@@ -0,0 +1,29 @@
+#ifndef VM_ARRAYS_H_
+#define VM_ARRAYS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+static const size_t ARRAY_MAX_LENGTH = (size_t)1 << 28; // 1GB of int32s
+
+typedef struct array {
+	size_t length;
+	int32_t data[]; // like String's str, the elements start at the end of the fixed fields
+} Array;
+
+// Allocated and freed through allocator_current() like Strings; NULL if
+// length is past ARRAY_MAX_LENGTH or there's no memory for it
+Array *Array_alloc(size_t length); // zeroed
+void Array_free(Array *a);
+Array *Array_new(int length); // length <= 0 gives an empty array
+Array *Array_dup(Array *orig);
+
+// Bulk ops for the ASUM..ASORT opcodes; min and max of an empty array are 0
+int Array_sum(Array *a); // wraps like IADD
+int Array_min(Array *a);
+int Array_max(Array *a);
+void Array_fill(Array *a, int value);
+void Array_sort(Array *a);
+const char *Array_kernels();
+
+#endif
@@ -2,14 +2,28 @@
 #include <string.h>
 #include <stdio.h>
 #include "vm_strings.h"
+#include "allocator.h"
 #include <assert.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STRING_SIMD
+#endif
 
 String *String_alloc(size_t length) {
-	String *p = (String *)calloc(1, sizeof(String) + (length+1) * sizeof(char));
+	Allocator *a = allocator_current();
+	String *p = (String *)a->alloc(a, sizeof(String) + (length+1) * sizeof(char));
 	p->length = length;
+	p->str[0] = '\0';
+	p->str[length] = '\0';
 	return p;
 }
 
+void String_free(String *s) {
+	if ( s == NULL ) return;
+	Allocator *a = allocator_current();
+	a->free(a, s, sizeof(String) + (s->length+1) * sizeof(char));
+}
+
 String *String_new(char *orig) {
 	String *s = String_alloc(strlen(orig));
 	strcpy(s->str, orig);
@@ -88,3 +102,203 @@ bool String_le(String *s, String *t) {
 	assert(t);
 	return strcmp(s->str, t->str) <= 0;
 }
+
+/*
+Find, equal-bytes and case-mapping kernels come in scalar, SSE2 and AVX2
+flavors. A constructor checks CPUID and points the kernels at the best
+this CPU has before main runs, so no thread ever sees them change.
+Find tests the needle's first and last char against 16 or 32 positions
+per compare and only memcmps where both match. Substring and repeat are
+memcpy, which libc already vectorizes.
+ */
+
+static long find_scalar(const char *s, size_t n, const char *t, size_t m) {
+	for (size_t i = 0; i + m <= n; i++) {
+		if ( s[i] == t[0] && memcmp(&s[i], t, m) == 0 ) return (long)i;
+	}
+	return -1;
+}
+
+static bool eq_scalar(const char *a, const char *b, size_t n) {
+	return memcmp(a, b, n) == 0;
+}
+
+/* flip case of chars in [lo, lo+25] */
+static void recase_scalar(char *dst, const char *src, size_t n, char lo) {
+	for (size_t i = 0; i < n; i++) {
+		char c = src[i];
+		dst[i] = c >= lo && c <= lo + 25 ? c ^ 0x20 : c;
+	}
+}
+
+#ifdef STRING_SIMD
+__attribute__((target("sse2")))
+static long find_sse2(const char *s, size_t n, const char *t, size_t m) {
+	__m128i first = _mm_set1_epi8(t[0]);
+	__m128i last = _mm_set1_epi8(t[m - 1]);
+	size_t i = 0;
+	for (; i + m + 15 <= n; i += 16) {
+		__m128i f = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)&s[i]));
+		__m128i l = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *)&s[i + m - 1]));
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(f, l));
+		while ( mask != 0 ) {
+			size_t j = i + (size_t)__builtin_ctz(mask);
+			if ( m <= 2 || memcmp(&s[j + 1], &t[1], m - 2) == 0 ) return (long)j;
+			mask &= mask - 1;
+		}
+	}
+	long r = find_scalar(&s[i], n - i, t, m);
+	return r < 0 ? -1 : (long)i + r;
+}
+
+__attribute__((target("sse2")))
+static bool eq_sse2(const char *a, const char *b, size_t n) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)&a[i]);
+		__m128i y = _mm_loadu_si128((const __m128i *)&b[i]);
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF ) return false;
+	}
+	return eq_scalar(&a[i], &b[i], n - i);
+}
+
+__attribute__((target("sse2")))
+static void recase_sse2(char *dst, const char *src, size_t n, char lo) {
+	__m128i below = _mm_set1_epi8((char)(lo - 1));
+	__m128i above = _mm_set1_epi8((char)(lo + 26));
+	__m128i bit = _mm_set1_epi8(0x20);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+		__m128i in = _mm_and_si128(_mm_cmpgt_epi8(v, below), _mm_cmplt_epi8(v, above));
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_xor_si128(v, _mm_and_si128(in, bit)));
+	}
+	recase_scalar(&dst[i], &src[i], n - i, lo);
+}
+
+__attribute__((target("avx2")))
+static long find_avx2(const char *s, size_t n, const char *t, size_t m) {
+	__m256i first = _mm256_set1_epi8(t[0]);
+	__m256i last = _mm256_set1_epi8(t[m - 1]);
+	size_t i = 0;
+	for (; i + m + 31 <= n; i += 32) {
+		__m256i f = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *)&s[i]));
+		__m256i l = _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i *)&s[i + m - 1]));
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(f, l));
+		while ( mask != 0 ) {
+			size_t j = i + (size_t)__builtin_ctz(mask);
+			if ( m <= 2 || memcmp(&s[j + 1], &t[1], m - 2) == 0 ) return (long)j;
+			mask &= mask - 1;
+		}
+	}
+	long r = find_sse2(&s[i], n - i, t, m);
+	return r < 0 ? -1 : (long)i + r;
+}
+
+__attribute__((target("avx2")))
+static bool eq_avx2(const char *a, const char *b, size_t n) {
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)&a[i]);
+		__m256i y = _mm256_loadu_si256((const __m256i *)&b[i]);
+		if ( (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xFFFFFFFFu ) return false;
+	}
+	return eq_sse2(&a[i], &b[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static void recase_avx2(char *dst, const char *src, size_t n, char lo) {
+	__m256i below = _mm256_set1_epi8((char)(lo - 1));
+	__m256i above = _mm256_set1_epi8((char)(lo + 26));
+	__m256i bit = _mm256_set1_epi8(0x20);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+		__m256i in = _mm256_and_si256(_mm256_cmpgt_epi8(v, below), _mm256_cmpgt_epi8(above, v));
+		_mm256_storeu_si256((__m256i *)&dst[i], _mm256_xor_si256(v, _mm256_and_si256(in, bit)));
+	}
+	recase_sse2(&dst[i], &src[i], n - i, lo);
+}
+#endif
+
+static long (*find_kernel)(const char *s, size_t n, const char *t, size_t m) = find_scalar;
+static bool (*eq_kernel)(const char *a, const char *b, size_t n) = eq_scalar;
+static void (*recase_kernel)(char *dst, const char *src, size_t n, char lo) = recase_scalar;
+static const char *kernels = "scalar";
+
+__attribute__((constructor))
+static void pick_kernels() {
+#ifdef STRING_SIMD
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") ) {
+		find_kernel = find_avx2;
+		eq_kernel = eq_avx2;
+		recase_kernel = recase_avx2;
+		kernels = "avx2";
+		return;
+	}
+	if ( __builtin_cpu_supports("sse2") ) {
+		find_kernel = find_sse2;
+		eq_kernel = eq_sse2;
+		recase_kernel = recase_sse2;
+		kernels = "sse2";
+		return;
+	}
+#endif
+}
+
+/* which kernels this CPU runs: "avx2", "sse2" or "scalar" */
+const char *String_kernels() {
+	return kernels;
+}
+
+/* n chars from 1-based index i, clipped to s */
+String *String_substr(String *s, int i, int n) {
+	size_t len = s->length;
+	size_t from = i < 1 ? 0 : (size_t)i - 1 > len ? len : (size_t)i - 1;
+	size_t count = n < 0 ? 0 : (size_t)n > len - from ? len - from : (size_t)n;
+	String *t = String_alloc(count);
+	memcpy(t->str, &s->str[from], count);
+	return t;
+}
+
+/* 1-based index of the first t in s, 0 if it's not there */
+int String_find(String *s, String *t) {
+	if ( t->length == 0 ) return 1; // like strstr
+	if ( t->length > s->length ) return 0;
+	return (int)find_kernel(s->str, s->length, t->str, t->length) + 1;
+}
+
+bool String_prefix(String *s, String *t) {
+	return t->length <= s->length && eq_kernel(s->str, t->str, t->length);
+}
+
+bool String_suffix(String *s, String *t) {
+	return t->length <= s->length && eq_kernel(&s->str[s->length - t->length], t->str, t->length);
+}
+
+/* s n times over; n <= 0 gives "" */
+String *String_repeat(String *s, int n) {
+	size_t total = n > 0 ? s->length * (size_t)n : 0;
+	String *t = String_alloc(total);
+	if ( total == 0 ) return t;
+	memcpy(t->str, s->str, s->length);
+	for (size_t done = s->length; done < total; ) { // double what's there each pass
+		size_t chunk = done < total - done ? done : total - done;
+		memcpy(&t->str[done], t->str, chunk);
+		done += chunk;
+	}
+	return t;
+}
+
+String *String_upper(String *s) {
+	String *t = String_alloc(s->length);
+	recase_kernel(t->str, s->str, s->length, 'a');
+	return t;
+}
+
+String *String_lower(String *s) {
+	String *t = String_alloc(s->length);
+	recase_kernel(t->str, s->str, s->length, 'A');
+	return t;
+}
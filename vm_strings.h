@@ -20,6 +20,7 @@ static String* NIL_STRING = NULL;
 
 // You need to implement this function 
 String *String_alloc(size_t length);
+void String_free(String *s);
 
 // You don't have to, but I have defined some useful functions
 // used by my VM:
@@ -37,4 +38,14 @@ bool String_lt(String *s, String *t);
 bool String_le(String *s, String *t);
 int String_len(String *s);
 
+// Bulk ops for the SSUBSTR..SLOWER opcodes; positions are 1-based like SINDEX
+String *String_substr(String *s, int i, int n);
+int String_find(String *s, String *t);
+bool String_prefix(String *s, String *t);
+bool String_suffix(String *s, String *t);
+String *String_repeat(String *s, int n);
+String *String_upper(String *s);
+String *String_lower(String *s);
+const char *String_kernels();
+
 #endif
@@ -0,0 +1,212 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdio.h>
+#include <time.h>
+#include "vm.h"
+#include "loader.h"
+
+/*
+usage: wbench [-n length] [-reps r]
+
+Times the bulk string and array opcodes against the SINDEX/ALOAD loops a
+program would otherwise write, on strings and arrays of about length
+elements, and checks both print the same thing. Each program is
+assembled from the listings below (labels end in ':', "$N" is replaced
+by length) and loaded once per rep; only vm_start through HALT is timed,
+with the trace off.
+ */
+
+typedef struct {
+    char *name;
+    char *strings[4];
+    char *loop[48];     // the SINDEX/ALOAD way
+    char *opcode[24];   // the same with the bulk opcode
+} Bench;
+
+static Bench benches[] = {
+    {"find", {"ab", "x"},
+     {"LOCALS 2", "SCONST 0", "ICONST $N", "SREPEAT", "SCONST 1", "SADD", "STORE 0",
+      "ICONST 1", "STORE 1",
+      "loop:", "LOAD 0", "LOAD 1", "SINDEX", "SCONST 1", "SEQ", "BRF next",
+      "LOAD 1", "PRINT", "HALT",
+      "next:", "LOAD 1", "ICONST 1", "IADD", "STORE 1", "BR loop"},
+     {"LOCALS 1", "SCONST 0", "ICONST $N", "SREPEAT", "SCONST 1", "SADD", "STORE 0",
+      "LOAD 0", "SCONST 1", "SFIND", "PRINT", "HALT"}},
+    {"substring", {"abc", ""},
+     {"LOCALS 3", "SCONST 0", "ICONST $N", "SREPEAT", "STORE 0",
+      "SCONST 1", "STORE 1", "ICONST 2", "STORE 2",
+      "loop:", "LOAD 2", "ICONST $N", "ILT", "BRF done",
+      "LOAD 1", "LOAD 0", "LOAD 2", "SINDEX", "SADD", "STORE 1",
+      "LOAD 2", "ICONST 1", "IADD", "STORE 2", "BR loop",
+      "done:", "LOAD 1", "SLEN", "PRINT", "HALT"},
+     {"LOCALS 1", "SCONST 0", "ICONST $N", "SREPEAT", "STORE 0",
+      "LOAD 0", "ICONST 2", "ICONST $N", "ICONST 2", "ISUB", "SSUBSTR", "SLEN", "PRINT", "HALT"}},
+    {"prefix", {"ab"},
+     {"LOCALS 3", "SCONST 0", "ICONST $N", "SREPEAT", "STORE 0",
+      "SCONST 0", "ICONST $N", "SREPEAT", "STORE 1", "ICONST 1", "STORE 2",
+      "loop:", "LOAD 2", "ICONST $N", "ICONST 2", "IMUL", "ILE", "BRF yes",
+      "LOAD 0", "LOAD 2", "SINDEX", "LOAD 1", "LOAD 2", "SINDEX", "SEQ", "BRF no",
+      "LOAD 2", "ICONST 1", "IADD", "STORE 2", "BR loop",
+      "yes:", "ICONST 1", "PRINT", "HALT",
+      "no:", "ICONST 0", "PRINT", "HALT"},
+     {"LOCALS 2", "SCONST 0", "ICONST $N", "SREPEAT", "STORE 0",
+      "SCONST 0", "ICONST $N", "SREPEAT", "STORE 1",
+      "LOAD 1", "LOAD 0", "SPREFIX", "BRF no", "ICONST 1", "PRINT", "HALT",
+      "no:", "ICONST 0", "PRINT", "HALT"}},
+    {"repeat", {"ab", ""},
+     {"LOCALS 2", "SCONST 1", "STORE 0", "ICONST 0", "STORE 1",
+      "loop:", "LOAD 1", "ICONST $N", "ILT", "BRF done",
+      "LOAD 0", "SCONST 0", "SADD", "STORE 0",
+      "LOAD 1", "ICONST 1", "IADD", "STORE 1", "BR loop",
+      "done:", "LOAD 0", "SLEN", "PRINT", "HALT"},
+     {"LOCALS 0", "SCONST 0", "ICONST $N", "SREPEAT", "SLEN", "PRINT", "HALT"}},
+    {"sum", {NULL},
+     {"LOCALS 3", "ICONST $N", "ANEW", "STORE 0", "LOAD 0", "ICONST 3", "AFILL",
+      "ICONST 0", "STORE 1", "ICONST 1", "STORE 2",
+      "loop:", "LOAD 2", "ICONST $N", "ILE", "BRF done",
+      "LOAD 1", "LOAD 0", "LOAD 2", "ALOAD", "IADD", "STORE 1",
+      "LOAD 2", "ICONST 1", "IADD", "STORE 2", "BR loop",
+      "done:", "LOAD 1", "PRINT", "HALT"},
+     {"LOCALS 1", "ICONST $N", "ANEW", "STORE 0", "LOAD 0", "ICONST 3", "AFILL",
+      "LOAD 0", "ASUM", "PRINT", "HALT"}},
+    {"max", {NULL},
+     {"LOCALS 3", "ICONST $N", "ANEW", "STORE 0", "LOAD 0", "ICONST 3", "AFILL",
+      "LOAD 0", "ICONST 1", "ALOAD", "STORE 1", "ICONST 2", "STORE 2",
+      "loop:", "LOAD 2", "ICONST $N", "ILE", "BRF done",
+      "LOAD 0", "LOAD 2", "ALOAD", "LOAD 1", "IGT", "BRF next",
+      "LOAD 0", "LOAD 2", "ALOAD", "STORE 1",
+      "next:", "LOAD 2", "ICONST 1", "IADD", "STORE 2", "BR loop",
+      "done:", "LOAD 1", "PRINT", "HALT"},
+     {"LOCALS 1", "ICONST $N", "ANEW", "STORE 0", "LOAD 0", "ICONST 3", "AFILL",
+      "LOAD 0", "AMAX", "PRINT", "HALT"}},
+};
+
+static double now_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+/* Turn a listing into .bytecode text with main at 0 and load it */
+static VM *assemble(char **strings, char **listing, int length)
+{
+    char *text = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&text, &size);
+    int nstrings = 0, ninstr = 0;
+    while ( nstrings<4 && strings[nstrings]!=NULL ) nstrings++;
+    fprintf(f, "%d strings\n", nstrings);
+    for (int i = 0; i < nstrings; i++) fprintf(f, "\t%d: %d/%s\n", i, (int)strlen(strings[i]), strings[i]);
+
+    char *labels[20];
+    addr32 label_addr[20];
+    int nlabels = 0;
+    addr32 addr = 0;
+    for (int i = 0; listing[i]!=NULL; i++) { // first pass: where each label lands
+        char name[80];
+        sscanf(listing[i], "%79s", name);
+        size_t len = strlen(listing[i]);
+        if ( listing[i][len-1]==':' ) {
+            labels[nlabels] = listing[i];
+            label_addr[nlabels++] = addr;
+            continue;
+        }
+        addr += (addr32)vm_instr_size(vm_instr(name)->opcode);
+        ninstr++;
+    }
+    fprintf(f, "1 functions maxaddr=0\n\t0: 4/main\n%d instr, %d bytes\n", ninstr, (int)addr);
+    for (int i = 0; listing[i]!=NULL; i++) {
+        char name[80], opnd[80];
+        int n = sscanf(listing[i], "%79s %79s", name, opnd);
+        if ( name[strlen(name)-1]==':' ) continue;
+        if ( n<2 ) {
+            fprintf(f, "\t%s\n", name);
+            continue;
+        }
+        if ( strcmp(opnd, "$N")==0 ) sprintf(opnd, "%d", length);
+        for (int l = 0; l < nlabels; l++) {
+            if ( strncmp(labels[l], opnd, strlen(opnd))==0 && labels[l][strlen(opnd)]==':' ) {
+                sprintf(opnd, "%u", label_addr[l]);
+            }
+        }
+        fprintf(f, "\t%s %s\n", name, opnd);
+    }
+    fclose(f);
+    f = fmemopen(text, size, "r");
+    VM *vm = vm_load(f);
+    fclose(f);
+    free(text);
+    return vm;
+}
+
+/* Best of reps runs; leaves the output of the last one in output */
+static double time_program(char **strings, char **listing, int length, int reps, char *output)
+{
+    double best = 0;
+    for (int r = 0; r < reps; r++) {
+        VM *vm = assemble(strings, listing, length);
+        if ( vm==NULL ) exit(1);
+        vm->tracing = false; // else it's mostly print() that gets timed
+        double start = now_ms();
+        vm_start(vm);
+        vm_resume(vm, false);
+        double ms = now_ms() - start;
+        if ( r==0 || ms<best ) best = ms;
+        strcpy(output, vm->output);
+        vm_free(vm);
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    int length = 10000;
+    int reps = 5;
+    for (int i = 1; i < argc; i++) {
+        if ( strcmp(argv[i], "-n")==0 && i+1<argc ) length = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-reps")==0 && i+1<argc ) reps = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "usage: wbench [-n length] [-reps r]\n");
+            return 1;
+        }
+    }
+    if ( length<4 || reps<1 ) return 1;
+
+    static char loop_out[MAX_OUTPUT], opcode_out[MAX_OUTPUT];
+    int mismatches = 0;
+    printf("string kernels: %s, array kernels: %s, length %d, best of %d\n",
+           String_kernels(), Array_kernels(), length, reps);
+    printf("%-10s %12s %12s %9s\n", "op", "loop ms", "opcode ms", "speedup");
+    for (int b = 0; b < (int)(sizeof(benches) / sizeof(benches[0])); b++) {
+        Bench *sb = &benches[b];
+        double loop_ms = time_program(sb->strings, sb->loop, length, reps, loop_out);
+        double opcode_ms = time_program(sb->strings, sb->opcode, length, reps, opcode_out);
+        bool same = strcmp(loop_out, opcode_out)==0;
+        if ( !same ) mismatches++;
+        printf("%-10s %12.3f %12.3f %8.1fx%s\n", sb->name, loop_ms, opcode_ms,
+               opcode_ms > 0 ? loop_ms / opcode_ms : 0.0, same ? "" : "  (output differs)");
+    }
+    return mismatches==0 ? 0 : 1;
+}
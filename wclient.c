@@ -0,0 +1,213 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "wserver.h"
+
+/*
+usage: wclient [-O] socket file.bytecode
+       wclient [-O] -bench n [-c clients] socket file.bytecode
+
+Runs file.bytecode on a wserver and prints its output like wrun would;
+exits 1 unless the program halted normally.
+
+  -O            inline small functions before running
+  -bench        send n requests from -c concurrent clients (default 8)
+                and report latency percentiles instead of output
+ */
+
+typedef struct {
+    struct sockaddr_un addr;
+    char request[SERVER_MAX_REQUEST];
+    int n;                  // requests in all
+    double *latency_ms;     // one per request
+    int next;               // next request to send; taken with __sync_fetch_and_add
+    int failed;
+} Bench;
+
+static double now_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+/* Send one request and read the whole reply. Returns the output (malloc'd)
+ * and sets ok if the program halted normally, or NULL if the server
+ * couldn't be reached.
+ */
+static char *run(struct sockaddr_un *addr, const char *request, char *status, bool *ok)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ( fd<0 || connect(fd, (struct sockaddr *)addr, sizeof(*addr))!=0 ) {
+        if ( fd>=0 ) close(fd);
+        return NULL;
+    }
+    size_t len = strlen(request);
+    for (size_t off = 0; off < len; ) {
+        ssize_t w = write(fd, request + off, len - off);
+        if ( w<0 && errno==EINTR ) continue;
+        if ( w<=0 ) break;
+        off += (size_t)w;
+    }
+    size_t cap = 4096, n = 0;
+    char *reply = malloc(cap);
+    for (;;) {
+        if ( n+1>=cap ) reply = realloc(reply, cap *= 2);
+        ssize_t r = read(fd, &reply[n], cap-1-n);
+        if ( r<0 && errno==EINTR ) continue;
+        if ( r<=0 ) break;
+        n += (size_t)r;
+    }
+    close(fd);
+    reply[n] = '\0';
+
+    size_t size = 0;
+    char *body = memchr(reply, '\n', n);
+    if ( body==NULL || sscanf(reply, "%15s %zu", status, &size)!=2 ) {
+        free(reply);
+        return NULL;
+    }
+    body++;
+    if ( size>n-(size_t)(body-reply) ) size = n-(size_t)(body-reply);
+    memmove(reply, body, size);
+    reply[size] = '\0';
+    *ok = strcmp(status, "ok")==0;
+    return reply;
+}
+
+static void *bench_client(void *arg)
+{
+    Bench *b = arg;
+    char status[16];
+    bool ok;
+    for (;;) {
+        int i = __sync_fetch_and_add(&b->next, 1);
+        if ( i>=b->n ) break;
+        double start = now_ms();
+        char *output = run(&b->addr, b->request, status, &ok);
+        b->latency_ms[i] = now_ms() - start;
+        if ( output==NULL || !ok ) __sync_fetch_and_add(&b->failed, 1);
+        free(output);
+    }
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double *sorted, int n, double p)
+{
+    int i = (int)(p / 100.0 * n);
+    return sorted[i < n ? i : n-1];
+}
+
+static int bench(Bench *b, int clients)
+{
+    pthread_t *t = calloc((size_t)clients, sizeof(pthread_t));
+    b->latency_ms = calloc((size_t)b->n, sizeof(double));
+    double start = now_ms();
+    for (int i = 0; i < clients; i++) pthread_create(&t[i], NULL, bench_client, b);
+    for (int i = 0; i < clients; i++) pthread_join(t[i], NULL);
+    double total_ms = now_ms() - start;
+
+    qsort(b->latency_ms, (size_t)b->n, sizeof(double), compare_doubles);
+    printf("%d requests from %d clients in %.1f ms, %.0f req/s, %d failed\n",
+           b->n, clients, total_ms, total_ms > 0 ? b->n * 1000.0 / total_ms : 0.0, b->failed);
+    printf("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+           percentile(b->latency_ms, b->n, 50), percentile(b->latency_ms, b->n, 90),
+           percentile(b->latency_ms, b->n, 99), percentile(b->latency_ms, b->n, 99.9),
+           b->latency_ms[b->n-1]);
+    free(t);
+    free(b->latency_ms);
+    return b->failed==0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    bool optimize = false;
+    int nbench = 0;
+    int clients = 8;
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if ( strcmp(argv[i], "-O")==0 ) optimize = true;
+        else if ( strcmp(argv[i], "-bench")==0 && i+1<argc ) nbench = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-c")==0 && i+1<argc ) clients = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if ( i+1>=argc || clients<1 ) {
+        fprintf(stderr, "usage: wclient [-O] socket file.bytecode\n");
+        fprintf(stderr, "       wclient [-O] -bench n [-c clients] socket file.bytecode\n");
+        return 1;
+    }
+
+    static Bench b;
+    b.addr.sun_family = AF_UNIX;
+    if ( strlen(argv[i])>=sizeof(b.addr.sun_path) ) {
+        fprintf(stderr, "socket path too long: %s\n", argv[i]);
+        return 1;
+    }
+    strcpy(b.addr.sun_path, argv[i]);
+    char path[PATH_MAX];
+    if ( realpath(argv[i+1], path)==NULL ) { // the server's cwd isn't ours
+        perror(argv[i+1]);
+        return 1;
+    }
+    int len = snprintf(b.request, sizeof(b.request), "%s%s\n", optimize ? "-O " : "", path);
+    if ( len<0 || len>=(int)sizeof(b.request) ) { // the server wouldn't read it all either
+        fprintf(stderr, "path too long for a request: %s\n", path);
+        return 1;
+    }
+    if ( nbench>0 ) {
+        b.n = nbench;
+        return bench(&b, clients);
+    }
+
+    char status[16];
+    bool ok = false;
+    char *output = run(&b.addr, b.request, status, &ok);
+    if ( output==NULL ) {
+        fprintf(stderr, "no reply from %s\n", b.addr.sun_path);
+        return 1;
+    }
+    if ( !ok ) fprintf(stderr, "wserver: %s\n", status);
+    puts(output);
+    free(output);
+    return ok ? 0 : 1;
+}
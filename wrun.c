@@ -22,16 +22,193 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include <stdio.h>
+#include <time.h>
 #include "vm.h"
 #include "loader.h"
+#include "optimizer.h"
+#include "checkpoint.h"
+#include "batch.h"
+#include "perf.h"
+#include "cache.h"
 
-int main(int argc, char *argv[])
+/*
+usage: wrun [-O] [-lazy] [-trace] [-stats] [-perf] [-cache dir] [-profile out | -layout in]
+            [-checkpoint snapshot -at func] file.bytecode
+       wrun [-trace] -restore snapshot
+       wrun [-O] -batch n file.bytecode
+
+  -O            inline small functions before running
+  -lazy         decode each function the first time it's called
+  -trace        dump the execution trace to stderr when done
+  -stats        print the VM's String allocation counters to stderr when done
+  -perf         report hardware counters per bytecode function to stderr
+                (wall-clock time only if perf_event_open isn't allowed);
+                turns off the trace while counting
+  -cache        load through a cache of decoded images in dir
+  -profile      count block executions and BRF outcomes into a profile
+  -layout       reorder basic blocks by a profile from -profile before running
+  -checkpoint   run until the first CALL to func then save the VM to snapshot
+  -restore      continue a VM saved by -checkpoint
+  -batch        run n instances in lockstep, instance i gets main(i), and
+                compare time and output against running them one at a time
+ */
+
+static double now_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+static void print_stats(VM *vm)
+{
+    Alloc_Stats *st = &vm->heap->stats;
+    fprintf(stderr, "allocs %lu, frees %lu, live %zu bytes, total %zu bytes\n",
+            st->allocs, st->frees, st->live_bytes, st->total_bytes);
+    fprintf(stderr, "%lu slabs, %lu large allocs, %zu bytes reserved\n",
+            st->slabs, st->large, st->reserved_bytes);
+}
+
+static int run_batch(char *file, int n, bool optimize)
 {
-    FILE *f = fopen(argv[1], "r");
-    if ( f!=NULL ) {
+    FILE *f = fopen(file, "r");
+    if ( f==NULL ) return 1;
+    VM *program = vm_load(f);
+    fclose(f);
+    if ( program==NULL ) return 1;
+    if ( optimize ) vm_optimize(program);
+    VM_Batch *b = vm_batch_alloc(program, n);
+    if ( b==NULL ) {
+        fprintf(stderr, "can't allocate %d lanes\n", n);
+        vm_free(program);
+        return 1;
+    }
+    for (int i = 0; i < n; i++) vm_batch_input(b, i, 1, &i);
+    double start = now_ms();
+    if ( !vm_batch_exec(b) ) {
+        fprintf(stderr, "%s can't run in lanes\n", file);
+        vm_batch_free(b);
+        vm_free(program);
+        return 1;
+    }
+    double batch_ms = now_ms() - start;
+
+    double single_ms = 0;
+    int mismatches = 0;
+    for (int i = 0; i < n; i++) {
+        f = fopen(file, "r");
         VM *vm = vm_load(f);
-        vm_exec(vm, false);
+        fclose(f);
+        if ( vm==NULL ) {
+            vm_batch_free(b);
+            vm_free(program);
+            return 1;
+        }
+        if ( optimize ) vm_optimize(vm);
+        vm->tracing = false; // lanes don't trace either
+        start = now_ms();
+        vm_start(vm);
+        vm->call_stack[0].nargs = 1;
+        vm->call_stack[0].locals[0].type = INT;
+        vm->call_stack[0].locals[0].i = i;
+        vm_resume(vm, false);
+        single_ms += now_ms() - start;
+        if ( strcmp(vm->output, b->output[i])!=0 ) mismatches++;
+        vm_free(vm);
+    }
+    printf("%d instances, %lu instrs in %lu lockstep steps (%.1f lanes/step)\n",
+           n, b->lane_instrs, b->steps, b->steps > 0 ? (double)b->lane_instrs / b->steps : 0.0);
+    printf("batch %.3f ms, one at a time %.3f ms, speedup %.2fx, %d output mismatches\n",
+           batch_ms, single_ms, batch_ms > 0 ? single_ms / batch_ms : 0.0, mismatches);
+    vm_batch_free(b);
+    vm_free(program);
+    return mismatches==0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    bool optimize = false;
+    bool trace = false;
+    bool stats = false;
+    bool perf = false;
+    bool lazy = false;
+    char *checkpoint = NULL, *at = NULL, *restore = NULL;
+    char *profile = NULL, *layout = NULL;
+    char *cache = NULL;
+    int batch = 0;
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if ( strcmp(argv[i], "-O")==0 ) optimize = true;
+        else if ( strcmp(argv[i], "-trace")==0 ) trace = true;
+        else if ( strcmp(argv[i], "-stats")==0 ) stats = true;
+        else if ( strcmp(argv[i], "-perf")==0 ) perf = true;
+        else if ( strcmp(argv[i], "-lazy")==0 ) lazy = true;
+        else if ( strcmp(argv[i], "-checkpoint")==0 && i+1<argc ) checkpoint = argv[++i];
+        else if ( strcmp(argv[i], "-at")==0 && i+1<argc ) at = argv[++i];
+        else if ( strcmp(argv[i], "-restore")==0 && i+1<argc ) restore = argv[++i];
+        else if ( strcmp(argv[i], "-profile")==0 && i+1<argc ) profile = argv[++i];
+        else if ( strcmp(argv[i], "-layout")==0 && i+1<argc ) layout = argv[++i];
+        else if ( strcmp(argv[i], "-cache")==0 && i+1<argc ) cache = argv[++i];
+        else if ( strcmp(argv[i], "-batch")==0 && i+1<argc ) batch = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if ( restore!=NULL ) {
+        VM *vm = vm_restore(restore);
+        if ( vm==NULL ) return 1;
+        vm_resume(vm, false);
         puts(vm->output);
+        if ( trace ) fputs(vm->trace, stderr);
+        if ( stats ) print_stats(vm);
+        return 0;
+    }
+    if ( i>=argc || (checkpoint!=NULL && at==NULL) ) {
+        fprintf(stderr, "usage: wrun [-O] [-lazy] [-trace] [-stats] [-perf] [-cache dir] [-profile out | -layout in]\n");
+        fprintf(stderr, "            [-checkpoint snapshot -at func] file.bytecode\n");
+        fprintf(stderr, "       wrun [-trace] -restore snapshot\n");
+        fprintf(stderr, "       wrun [-O] -batch n file.bytecode\n");
+        return 1;
+    }
+    if ( batch>0 ) return run_batch(argv[i], batch, optimize);
+    VM *vm = NULL;
+    if ( cache!=NULL ) vm = vm_cache_load(cache, argv[i], optimize, CACHE_MAX_BYTES);
+    else {
+        FILE *f = fopen(argv[i], "r");
+        if ( f!=NULL ) {
+            vm = lazy ? vm_load_lazy(f) : vm_load(f);
+            fclose(f);
+            if ( vm!=NULL && optimize ) vm_optimize(vm);
+        }
+    }
+    if ( vm==NULL ) return 0;
+    if ( layout!=NULL ) {
+        if ( !vm_profile_read(vm, layout) ) return 1;
+        vm_layout(vm);
+    }
+    if ( profile!=NULL ) vm_profile_start(vm);
+    if ( checkpoint!=NULL ) {
+        vm->break_addr = vm_function(vm, at);
+        if ( vm->break_addr==NO_ADDR ) {
+            fprintf(stderr, "no function %s\n", at);
+            return 1;
+        }
+        vm_start(vm);
+        if ( vm_resume(vm, false) ) {
+            fprintf(stderr, "program halted before calling %s; no snapshot\n", at);
+            puts(vm->output);
+            return 1;
+        }
+        return vm_checkpoint(vm, checkpoint) ? 0 : 1;
     }
+    vm_start(vm);
+    if ( perf ) vm_perf_open(vm);
+    vm_resume(vm, false);
+    puts(vm->output);
+    if ( trace ) fputs(vm->trace, stderr);
+    if ( stats ) print_stats(vm);
+    if ( perf ) vm_perf_report(vm, stderr);
+    if ( profile!=NULL && !vm_profile_write(vm, profile) ) return 1;
     return 0;
 }
@@ -0,0 +1,388 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Terence Parr, Hanzhou Shi, Shuai Yuan, Yuanyuan Zhang
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "vm.h"
+#include "loader.h"
+#include "optimizer.h"
+#include "natives.h"
+#include "wserver.h"
+
+/*
+usage: wserver [-threads n] [-pool n] [-timeout ms] socket
+
+Listens on a Unix domain socket and runs bytecode files for wclient.
+A request is one line, "[-O] /abs/path.bytecode\n". The reply is a line
+"status length\n" (status is ok, error, timeout or noload) then length
+bytes of the program's output.
+
+Loaded programs stay cached by path, -O and the file's size and mtime,
+so editing a file reloads it. Loading happens outside the cache's lock
+so a cold program doesn't hold up the rest, and only the
+SERVER_MAX_PROGRAMS most recently used stay loaded. A run borrows the cached code and string
+constants and gets a VM from a pool allocated at startup; afterwards
+vm_reset empties it and it goes back in the pool, so a request pays for
+neither the file nor vm_alloc.
+
+  -threads      worker threads running requests (default 4)
+  -pool         VMs allocated up front (default one per thread)
+  -timeout      stop a program after this many ms (default no limit)
+ */
+
+typedef struct program {
+    char *path;
+    bool optimize;
+    struct timespec mtime;
+    off_t size;
+    VM *vm;                 // loaded once; runs point at its code and constants
+    int refs;               // runs using it, plus one while it's in the cache
+    unsigned long used;     // programs_clock at its last request
+    struct program *next;
+} Program;
+
+static Program *programs = NULL;
+static int num_programs = 0;
+static unsigned long programs_clock = 0;
+static pthread_mutex_t programs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static VM **pool;
+static int pool_free_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static int queue[SERVER_QUEUE_SIZE];
+static int queue_head = 0, queue_len = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_space = PTHREAD_COND_INITIALIZER;
+
+static long timeout_nanos = 0;
+
+static void program_free(Program *p)
+{
+    vm_free(p->vm);
+    free(p->path);
+    free(p);
+}
+
+static void program_put(Program *p)
+{
+    pthread_mutex_lock(&programs_lock);
+    bool last = --p->refs == 0;
+    pthread_mutex_unlock(&programs_lock);
+    if ( last ) program_free(p);
+}
+
+/* Take p out of the cache; if nothing is running it, onto *dead to free
+ * once the lock is dropped. Call with programs_lock held.
+ */
+static void program_unlink(Program **link, Program **dead)
+{
+    Program *p = *link;
+    *link = p->next;
+    num_programs--;
+    if ( --p->refs==0 ) {
+        p->next = *dead;
+        *dead = p;
+    }
+}
+
+/* The cached copy of path as of st, with a ref for the caller; drops an
+ * out of date copy. Call with programs_lock held.
+ */
+static Program *program_find(char *path, bool optimize, struct stat *st, Program **dead)
+{
+    for (Program **link = &programs; *link!=NULL; link = &(*link)->next) {
+        Program *p = *link;
+        if ( p->optimize!=optimize || strcmp(p->path, path)!=0 ) continue;
+        if ( p->size==st->st_size && p->mtime.tv_sec==st->st_mtim.tv_sec &&
+             p->mtime.tv_nsec==st->st_mtim.tv_nsec ) {
+            p->refs++;
+            p->used = ++programs_clock;
+            return p;
+        }
+        program_unlink(link, dead); // stale; whoever is still running it frees it
+        return NULL;
+    }
+    return NULL;
+}
+
+static void programs_free(Program *dead)
+{
+    while ( dead!=NULL ) {
+        Program *next = dead->next;
+        program_free(dead);
+        dead = next;
+    }
+}
+
+/* The cached program for path, loading it if it's new or the file changed */
+static Program *program_get(char *path, bool optimize)
+{
+    struct stat st;
+    if ( stat(path, &st)!=0 ) return NULL;
+    Program *dead = NULL;
+    pthread_mutex_lock(&programs_lock);
+    Program *p = program_find(path, optimize, &st, &dead);
+    pthread_mutex_unlock(&programs_lock);
+    programs_free(dead);
+    if ( p!=NULL ) return p;
+
+    // load unlocked; two threads missing at once both load and one copy wins
+    FILE *f = fopen(path, "r");
+    VM *vm = f!=NULL ? vm_load(f) : NULL;
+    if ( f!=NULL ) fclose(f);
+    if ( vm==NULL ) return NULL;
+    if ( optimize ) vm_optimize(vm);
+    Program *loaded = calloc(1, sizeof(Program));
+    loaded->path = strdup(path);
+    loaded->optimize = optimize;
+    loaded->mtime = st.st_mtim;
+    loaded->size = st.st_size;
+    loaded->vm = vm;
+
+    dead = NULL;
+    pthread_mutex_lock(&programs_lock);
+    p = program_find(path, optimize, &st, &dead);
+    if ( p==NULL ) {
+        p = loaded;
+        p->refs = 2;
+        p->used = ++programs_clock;
+        p->next = programs;
+        programs = p;
+        num_programs++;
+        while ( num_programs>SERVER_MAX_PROGRAMS ) {
+            Program **oldest = NULL;
+            for (Program **link = &programs; *link!=NULL; link = &(*link)->next) {
+                if ( oldest==NULL || (*link)->used<(*oldest)->used ) oldest = link;
+            }
+            program_unlink(oldest, &dead);
+        }
+    }
+    else { // another thread got there first
+        loaded->next = dead;
+        dead = loaded;
+    }
+    pthread_mutex_unlock(&programs_lock);
+    programs_free(dead);
+    return p;
+}
+
+static VM *pool_take()
+{
+    pthread_mutex_lock(&pool_lock);
+    while ( pool_free_count==0 ) pthread_cond_wait(&pool_cond, &pool_lock);
+    VM *vm = pool[--pool_free_count];
+    pthread_mutex_unlock(&pool_lock);
+    return vm;
+}
+
+static void pool_give(VM *vm)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool[pool_free_count++] = vm;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Point a pooled VM at a loaded program; nothing is copied */
+static void borrow(VM *vm, VM *program)
+{
+    vm->code = program->code;
+    vm->code_size = program->code_size;
+    vm->num_functions = program->num_functions;
+    vm->max_func_addr = program->max_func_addr;
+    vm->func_names = program->func_names;
+    vm->num_strings = program->num_strings;
+    vm->strings = program->strings;
+    vm->inlined_from = program->inlined_from;
+}
+
+static void give_back(VM *vm)
+{
+    vm->code = NULL;
+    vm->code_size = 0;
+    vm->num_functions = 0;
+    vm->max_func_addr = -1;
+    vm->func_names = NULL;
+    vm->num_strings = 0;
+    vm->strings = NULL;
+    vm->inlined_from = NULL;
+}
+
+static bool write_all(int fd, const char *buf, size_t n)
+{
+    while ( n>0 ) {
+        ssize_t w = write(fd, buf, n);
+        if ( w<0 && errno==EINTR ) continue;
+        if ( w<=0 ) return false;
+        buf += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+static void reply(int fd, const char *status, const char *output)
+{
+    char header[64];
+    size_t n = strlen(output);
+    int len = snprintf(header, sizeof(header), "%s %zu\n", status, n);
+    if ( write_all(fd, header, (size_t)len) ) write_all(fd, output, n);
+}
+
+/* Read one request line into buf; false if the client went away first */
+static bool read_request(int fd, char *buf, size_t size)
+{
+    size_t n = 0;
+    while ( n<size-1 ) {
+        ssize_t r = read(fd, &buf[n], size-1-n);
+        if ( r<0 && errno==EINTR ) continue;
+        if ( r<=0 ) return false;
+        char *nl = memchr(&buf[n], '\n', (size_t)r);
+        n += (size_t)r;
+        if ( nl!=NULL ) {
+            *nl = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+static void serve(int fd)
+{
+    char line[SERVER_MAX_REQUEST];
+    if ( !read_request(fd, line, sizeof(line)) ) return;
+    bool optimize = false;
+    char *path = line;
+    if ( strncmp(path, "-O ", 3)==0 ) {
+        optimize = true;
+        path += 3;
+    }
+    Program *p = program_get(path, optimize);
+    if ( p==NULL ) {
+        reply(fd, "noload", "");
+        return;
+    }
+    VM *vm = pool_take();
+    borrow(vm, p->vm);
+    vm_start(vm);
+    VM_STATUS status = vm_step(vm, 0, timeout_nanos, false);
+    reply(fd, status==VM_HALTED ? "ok" : status==VM_ERROR ? "error" : "timeout", vm->output);
+    give_back(vm);
+    vm_reset(vm);
+    pool_give(vm);
+    program_put(p);
+}
+
+static void *worker(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while ( queue_len==0 ) pthread_cond_wait(&queue_cond, &queue_lock);
+        int fd = queue[queue_head];
+        queue_head = (queue_head + 1) % SERVER_QUEUE_SIZE;
+        queue_len--;
+        pthread_cond_signal(&queue_space);
+        pthread_mutex_unlock(&queue_lock);
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 4;
+    int npool = 0;
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if ( strcmp(argv[i], "-threads")==0 && i+1<argc ) threads = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-pool")==0 && i+1<argc ) npool = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-timeout")==0 && i+1<argc ) timeout_nanos = atol(argv[++i]) * 1000000L;
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if ( i>=argc || threads<1 ) {
+        fprintf(stderr, "usage: wserver [-threads n] [-pool n] [-timeout ms] socket\n");
+        return 1;
+    }
+    if ( npool<1 ) npool = threads;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if ( strlen(argv[i])>=sizeof(addr.sun_path) ) {
+        fprintf(stderr, "socket path too long: %s\n", argv[i]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[i]);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(addr.sun_path);
+    if ( s<0 || bind(s, (struct sockaddr *)&addr, sizeof(addr))!=0 || listen(s, SERVER_QUEUE_SIZE)!=0 ) {
+        perror(argv[i]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // a client that hangs up early mustn't kill us
+
+    vm_natives_init();
+    pool = calloc((size_t)npool, sizeof(VM *));
+    for (int j = 0; j < npool; j++) {
+        VM *vm = vm_alloc();
+        if ( vm==NULL ) return 1;
+        vm_init(vm, NULL, 0);
+        vm->tracing = false; // only the output goes back to the client
+        give_back(vm);
+        pool[pool_free_count++] = vm;
+    }
+    for (int j = 0; j < threads; j++) {
+        pthread_t t;
+        pthread_create(&t, NULL, worker, NULL);
+        pthread_detach(t);
+    }
+    fprintf(stderr, "wserver: %d threads, %d VMs on %s\n", threads, npool, addr.sun_path);
+
+    for (;;) {
+        int fd = accept(s, NULL, NULL);
+        if ( fd<0 ) {
+            if ( errno==EINTR || errno==ECONNABORTED ) continue;
+            perror("accept");
+            return 1;
+        }
+        pthread_mutex_lock(&queue_lock);
+        while ( queue_len==SERVER_QUEUE_SIZE ) pthread_cond_wait(&queue_space, &queue_lock);
+        queue[(queue_head + queue_len) % SERVER_QUEUE_SIZE] = fd;
+        queue_len++;
+        pthread_cond_signal(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+    }
+}